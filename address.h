@@ -0,0 +1,44 @@
+/*
+ * Network Addresses of book and bench
+ *
+ * serve, --metrics, --redis, and bench all take an address as a path
+ * containing '/' for a Unix socket, or [HOST:]PORT otherwise, where HOST
+ * defaults to the loopback address and an IPv6 HOST goes in brackets, e.g.,
+ * [::1]:7000.
+ */
+
+#ifndef ADDRESS_H
+#define ADDRESS_H
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Split [HOST:]PORT into host, a string of size bytes, and port, which
+ * points into address.
+ *
+ * return: 0 on success, -1 if HOST is too long
+ */
+static int split_address(const char *address, char *host, size_t size,
+                         const char **port)
+{
+    const char *colon = strrchr(address, ':');
+    const char *start = address, *end = colon;
+
+    snprintf(host, size, "127.0.0.1");
+    *port = colon ? colon + 1 : address;
+    if (colon == NULL) return 0;
+    if (*start == '[' && end > start && end[-1] == ']') {
+        start++;
+        end--;
+    }
+    if ((size_t)(end - start) >= size) {
+        fprintf(stderr, "%s: host too long\n", address);
+        return -1;
+    }
+    memcpy(host, start, end - start);
+    host[end - start] = '\0';
+    return 0;
+}
+
+#endif
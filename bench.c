@@ -0,0 +1,416 @@
+/*
+ * Load Generator for book serve
+ *
+ * bench connects to a running "book --compact serve ADDRESS", seeds a book
+ * of the given depth around a mid price, and then sends a synthetic order
+ * flow one command at a time, timing each from the request to its reply.
+ * --compact makes every reply a single line, which is how bench frames
+ * them.
+ *
+ * Each step is one of:
+ *     bid or ask  a passive order DEPTH ticks or less from the mid price,
+ *                 or with --cross-rate, one priced through the other side,
+ *                 followed by a match unless the server matches on arrival
+ *     cancel      of a random order placed before (--cancel-ratio)
+ *     list        (--list-ratio)
+ *     history     of the latest 10 trades (--history-ratio)
+ *
+ * At the end, the throughput and the latency percentiles of each operation
+ * are printed.
+ */
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "address.h"
+
+enum op { OP_ORDER, OP_MATCH, OP_CANCEL, OP_LIST, OP_HISTORY, N_OPS };
+
+static const char *op_name[N_OPS] = {
+    "bid/ask", "match", "cancel", "list", "history"
+};
+
+/*
+ * The latencies of one operation in nanoseconds.
+ */
+struct samples {
+    long long *ns;
+    size_t n, size;
+};
+
+static struct samples samples[N_OPS];
+
+/* the connection to the server and what has been read from it */
+static int fd;
+static char *in;
+static size_t in_len, in_size;
+
+/* --timeout: how long to wait for a reply line in milliseconds */
+static int timeout_ms = 10000;
+
+/* the IDs of the orders placed so far, for cancel */
+static long long *ids;
+static size_t n_ids, ids_size;
+
+static long long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Connect to [HOST:]PORT or a Unix socket path, as serve takes them.
+ *
+ * return: the socket, or -1 on error
+ */
+static int connect_to(const char *address)
+{
+    const char *port;
+    char host[256];
+    struct addrinfo hints, *res, *ai;
+    int s = -1, on = 1, err;
+
+    if (strchr(address, '/')) {
+        struct sockaddr_un sun;
+
+        if (strlen(address) >= sizeof(sun.sun_path)) {
+            fprintf(stderr, "%s: path too long\n", address);
+            return -1;
+        }
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, address);
+        s = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (s < 0 || connect(s, (struct sockaddr *)&sun, sizeof(sun))) {
+            perror(address);
+            if (s >= 0) close(s);
+            return -1;
+        }
+        return s;
+    }
+
+    if (split_address(address, host, sizeof(host), &port)) return -1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    err = getaddrinfo(host, port, &hints, &res);
+    if (err) {
+        fprintf(stderr, "%s: %s\n", address, gai_strerror(err));
+        return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s < 0) continue;
+        if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(s);
+        s = -1;
+    }
+    if (s < 0) perror(address);
+    else setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    freeaddrinfo(res);
+    return s;
+}
+
+/*
+ * Send a command and wait for its reply line, but no longer than
+ * --timeout, as a command that fails may print nothing but to the stderr
+ * of the server.
+ *
+ * reply: size bytes for the start of the reply, or NULL
+ * return: the latency in nanoseconds, or -1 if the connection is lost or
+ *         no reply came
+ */
+static long long run(enum op op, const char *cmd, char *reply, size_t size)
+{
+    size_t len = strlen(cmd), sent = 0;
+    long long start = now_ns(), left, ns;
+    struct pollfd pfd = {fd, POLLIN, 0};
+    char *eol;
+    ssize_t r;
+
+    while (sent < len) {
+        r = write(fd, cmd + sent, len - sent);
+        if (r <= 0) {
+            fputs("connection lost\n", stderr);
+            return -1;
+        }
+        sent += r;
+    }
+    while ((eol = memchr(in, '\n', in_len)) == NULL) {
+        if (in_len == in_size) {
+            in_size = in_size ? 2 * in_size : 1 << 16;
+            in = realloc(in, in_size);
+        }
+        left = timeout_ms - (now_ns() - start) / 1000000;
+        if (left <= 0 || poll(&pfd, 1, left) == 0) {
+            fprintf(stderr, "no reply in %d ms to: %s", timeout_ms, cmd);
+            return -1;
+        }
+        r = read(fd, in + in_len, in_size - in_len);
+        if (r <= 0) {
+            fputs("connection lost\n", stderr);
+            return -1;
+        }
+        in_len += r;
+    }
+    ns = now_ns() - start;
+
+    if (reply) {
+        len = (size_t)(eol - in) < size ? (size_t)(eol - in) : size - 1;
+        memcpy(reply, in, len);
+        reply[len] = '\0';
+    }
+    in_len -= eol + 1 - in;
+    memmove(in, eol + 1, in_len);
+
+    struct samples *s = &samples[op];
+    if (s->n == s->size) {
+        s->size = s->size ? 2 * s->size : 1024;
+        s->ns = realloc(s->ns, s->size * sizeof(long long));
+    }
+    s->ns[s->n++] = ns;
+    return ns;
+}
+
+/*
+ * return: a uniform random number in [0, 1)
+ */
+static double uniform()
+{
+    return (double)random() / ((double)RAND_MAX + 1);
+}
+
+/*
+ * return: the distance from the mid price in ticks, in [1, depth]
+ */
+static int draw_ticks(const char *distribution, int depth)
+{
+    int ticks;
+
+    if (strcmp(distribution, "exponential") == 0) {
+        /* most orders near the top of the book, as on a real venue */
+        ticks = 1 + (int)(-log(1 - uniform()) * depth / 4);
+    } else {
+        ticks = 1 + (int)(uniform() * depth);
+    }
+    return ticks > depth ? depth : ticks;
+}
+
+/*
+ * Place an order and remember its ID.
+ *
+ * return: 0, or -1 if the connection is lost or no reply came
+ */
+static int order(const char *symbol, int which, double price, double amount)
+{
+    char cmd[128], reply[32];
+    long long id;
+
+    snprintf(cmd, sizeof(cmd), "%s %s%sbench %.2f %.4f\n",
+             which ? "ask" : "bid", symbol, *symbol ? " " : "", price,
+             amount);
+    if (run(OP_ORDER, cmd, reply, sizeof(reply)) < 0) return -1;
+    id = strtoll(reply, NULL, 10);
+    if (id > 0) {
+        if (n_ids == ids_size) {
+            ids_size = ids_size ? 2 * ids_size : 1024;
+            ids = realloc(ids, ids_size * sizeof(long long));
+        }
+        ids[n_ids++] = id;
+    }
+    return 0;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * s->ns: sorted
+ * return: the latency at quantile q in microseconds
+ */
+static double percentile(const struct samples *s, double q)
+{
+    size_t i = (size_t)ceil(q * s->n);
+
+    if (s->n == 0) return 0;
+    if (i > 0) i--;
+    return s->ns[i < s->n ? i : s->n - 1] / 1000.0;
+}
+
+static void report(double seconds)
+{
+    size_t total = 0;
+    int op;
+
+    printf("%-8s %9s %10s %10s %10s %10s %10s\n", "op", "count", "ops/s",
+           "p50 us", "p99 us", "p99.9 us", "max us");
+    for (op = 0; op < N_OPS; op++) {
+        struct samples *s = &samples[op];
+        if (s->n == 0) continue;
+        qsort(s->ns, s->n, sizeof(long long), compare_ns);
+        printf("%-8s %9zu %10.0f %10.1f %10.1f %10.1f %10.1f\n",
+               op_name[op], s->n, s->n / seconds, percentile(s, 0.5),
+               percentile(s, 0.99), percentile(s, 0.999),
+               s->ns[s->n - 1] / 1000.0);
+        total += s->n;
+    }
+    printf("%-8s %9zu %10.0f\n", "total", total, total / seconds);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [OPTIONS] [ADDRESS]\n", prog);
+    fputs("  --orders N          Number of steps after seeding (100000)\n"
+          "  --depth N           Levels per side, in ticks from the mid "
+          "(100)\n"
+          "  --mid PRICE         Mid price (7900)\n"
+          "  --tick PRICE        Price step (0.1)\n"
+          "  --distribution D    uniform or exponential distance from the "
+          "mid (uniform)\n"
+          "  --cross-rate R      Fraction of orders crossing the spread "
+          "(0.1)\n"
+          "  --cancel-ratio R    Fraction of steps that cancel (0.2)\n"
+          "  --list-ratio R      Fraction of steps that list (0.01)\n"
+          "  --history-ratio R   Fraction of steps that read history "
+          "(0.01)\n"
+          "  --auto-match        The server runs with --auto-match, so "
+          "do not send match\n"
+          "  --symbol SYMBOL     Use the book of SYMBOL\n"
+          "  --seed N            Seed of the random flow (1)\n"
+          "  --timeout MS        Give up waiting for a reply after MS "
+          "milliseconds (10000)\n", stderr);
+}
+
+int main(int argc, char **argv)
+{
+    enum {
+        OPT_ORDERS = 256, OPT_DEPTH, OPT_MID, OPT_TICK, OPT_DISTRIBUTION,
+        OPT_CROSS_RATE, OPT_CANCEL_RATIO, OPT_LIST_RATIO, OPT_HISTORY_RATIO,
+        OPT_AUTO_MATCH, OPT_SYMBOL, OPT_SEED, OPT_TIMEOUT
+    };
+    static const struct option options[] = {
+        {"orders", required_argument, NULL, OPT_ORDERS},
+        {"depth", required_argument, NULL, OPT_DEPTH},
+        {"mid", required_argument, NULL, OPT_MID},
+        {"tick", required_argument, NULL, OPT_TICK},
+        {"distribution", required_argument, NULL, OPT_DISTRIBUTION},
+        {"cross-rate", required_argument, NULL, OPT_CROSS_RATE},
+        {"cancel-ratio", required_argument, NULL, OPT_CANCEL_RATIO},
+        {"list-ratio", required_argument, NULL, OPT_LIST_RATIO},
+        {"history-ratio", required_argument, NULL, OPT_HISTORY_RATIO},
+        {"auto-match", no_argument, NULL, OPT_AUTO_MATCH},
+        {"symbol", required_argument, NULL, OPT_SYMBOL},
+        {"seed", required_argument, NULL, OPT_SEED},
+        {"timeout", required_argument, NULL, OPT_TIMEOUT},
+        {NULL, 0, NULL, 0}
+    };
+    long orders = 100000, i;
+    int depth = 100, auto_match = 0, opt, which, ticks;
+    double mid = 7900, tick = 0.1, cross_rate = 0.1, cancel_ratio = 0.2;
+    double list_ratio = 0.01, history_ratio = 0.01, r, price;
+    const char *distribution = "uniform", *symbol = "";
+    char cmd[128];
+    long long start;
+
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_ORDERS: orders = atol(optarg); break;
+        case OPT_DEPTH: depth = atoi(optarg); break;
+        case OPT_MID: mid = atof(optarg); break;
+        case OPT_TICK: tick = atof(optarg); break;
+        case OPT_DISTRIBUTION: distribution = optarg; break;
+        case OPT_CROSS_RATE: cross_rate = atof(optarg); break;
+        case OPT_CANCEL_RATIO: cancel_ratio = atof(optarg); break;
+        case OPT_LIST_RATIO: list_ratio = atof(optarg); break;
+        case OPT_HISTORY_RATIO: history_ratio = atof(optarg); break;
+        case OPT_AUTO_MATCH: auto_match = 1; break;
+        case OPT_SYMBOL: symbol = optarg; break;
+        case OPT_SEED: srandom(atoi(optarg)); break;
+        case OPT_TIMEOUT: timeout_ms = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || depth < 1 || tick <= 0 || mid <= depth * tick ||
+        timeout_ms <= 0 ||
+        (strcmp(distribution, "uniform") != 0 &&
+         strcmp(distribution, "exponential") != 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+    fd = connect_to(argv[optind]);
+    if (fd < 0) return 1;
+
+    /* one order at each level of both sides */
+    for (ticks = 1; ticks <= depth; ticks++) {
+        if (order(symbol, 0, mid - ticks * tick, 1) ||
+            order(symbol, 1, mid + ticks * tick, 1)) {
+            return 1;
+        }
+    }
+    for (i = 0; i < N_OPS; i++) free(samples[i].ns);
+    memset(samples, 0, sizeof(samples));
+
+    start = now_ns();
+    for (i = 0; i < orders; i++) {
+        long long ns;
+        r = uniform();
+        if (r < cancel_ratio && n_ids > 0) {
+            size_t k = random() % n_ids;
+            snprintf(cmd, sizeof(cmd), "cancel %s%s%lld\n", symbol,
+                     *symbol ? " " : "", ids[k]);
+            ids[k] = ids[--n_ids];
+            ns = run(OP_CANCEL, cmd, NULL, 0);
+        } else if ((r -= cancel_ratio) < list_ratio) {
+            snprintf(cmd, sizeof(cmd), "list%s%s\n", *symbol ? " " : "",
+                     symbol);
+            ns = run(OP_LIST, cmd, NULL, 0);
+        } else if ((r -= list_ratio) < history_ratio) {
+            snprintf(cmd, sizeof(cmd), "history %s%s0 9\n", symbol,
+                     *symbol ? " " : "");
+            ns = run(OP_HISTORY, cmd, NULL, 0);
+        } else {
+            which = random() & 1;
+            ticks = draw_ticks(distribution, depth);
+            if (uniform() < cross_rate) {
+                /* through the best price of the other side */
+                price = which ? mid - ticks * tick : mid + ticks * tick;
+            } else {
+                price = which ? mid + ticks * tick : mid - ticks * tick;
+            }
+            if (order(symbol, which, price, 1 + random() % 10)) {
+                ns = -1;
+            } else if (!auto_match && (which ? price < mid : price > mid)) {
+                snprintf(cmd, sizeof(cmd), "match%s%s\n",
+                         *symbol ? " " : "", symbol);
+                ns = run(OP_MATCH, cmd, NULL, 0);
+            } else {
+                ns = 0;
+            }
+        }
+        if (ns < 0) return 1;
+    }
+
+    report((now_ns() - start) / 1e9);
+    close(fd);
+    return 0;
+}
@@ -1,475 +1,5589 @@
 /*
  * Data Structure to Store Order Book Information in Redis
  *
+ * Prices and amounts are fixed-point numbers kept as integers in units of
+ * 1 / FIXED_ONE, e.g., the price 7902.4 is stored as 790240000000.
+ *
  * bid_prices (sorted_set):
  *     This data structure contains all the unmatched bid prices. The score of
  *     a member is the same as the member itself. In this way, Redis will sort
- *     the prices for us automatically.
+ *     the prices for us automatically. Scores are exact, since the prices are
+ *     integers below FIXED_MAX = 2^53.
+ *
+ * bid_queue@[PRICE] (list):
+ *     bid_queue@[PRICE] exists if and only if PRICE is a member of
+ *     bid_prices. It is a FIFO queue of the bid orders at PRICE, each packed
+ *     into one element "ID USER", so that an order costs one list node and
+ *     one command to add or pop. What is left of its amount is in orders. A
+ *     cancelled order is left in the queue and dropped when it reaches the
+ *     head.
  *
- * bid_amounts@[PRICE] (list):
- *     bid_amounts@[PRICE] exists if and only if PRICE is a member of bid_prices.
- *     It is a FIFO queue of bid orders at PRICE and its elements represent bid
- *     amounts.
+ * bid_level_amounts (hash):
+ *     Maps each member of bid_prices to the sum of the amounts of the orders
+ *     at PRICE, so that the depth can be read without walking the queues.
  *
- * bid_users@[PRICE] (list):
- *     Similar to bid_amounts@[PRICE] except the elements of bid_users@[PRICE]
- *     represent bid users.
+ * bid_level_counts (hash):
+ *     Maps each member of bid_prices to the number of orders at PRICE, not
+ *     counting the cancelled ones. A price is removed once its count drops
+ *     to 0.
  *
- * ask_prices, ask_amounts@[PRICE], and ask_users@[PRICE]:
+ * ask_prices, ask_queue@[PRICE], ask_level_amounts, and ask_level_counts:
  *     The ask version of the above data structures.
  *
- * matched_[FIELD] (list):
- *     A FIFO queue of matched FIELD. FIELD can be bidders, bidprices, askers,
- *     askprices, amounts, and timestamps.
+ * orders (hash):
+ *     Maps the ID of each order in the book to "SIDE PRICE AMOUNT", where
+ *     SIDE is 0 for a bid and 1 for an ask, and AMOUNT is what is left of
+ *     it. Cancelling an order deletes its field.
+ *
+ * order_ids (string):
+ *     The last order ID allocated, shared by all the books.
+ *
+ * market (Pub/Sub channel, with --publish):
+ *     Every change of a level and every trade of the book, as one message
+ *     "SEQ L SIDE PRICE COUNT AMOUNT" with the new count and amount of the
+ *     level (0 0 once it is gone), "SEQ T BID_PRICE ASK_PRICE AMOUNT
+ *     TIMESTAMP" with TIMESTAMP in seconds and 9 decimals, or "SEQ C" when
+ *     the book is cleared. SEQ is taken from market_seq (string), so a
+ *     subscriber can tell whether it missed a message.
+ *
+ * matched_trades (list):
+ *     The trades, latest first. Each element is a trade record packed by
+ *     pack_trade(): a version byte, then bid price, ask price, amount, and
+ *     the seconds of the timestamp as little-endian 64-bit integers, its
+ *     nanoseconds and the number of the fill in its match cycle as
+ *     little-endian 32-bit integers, then the bidder and the asker, each as
+ *     a length byte followed by the name. Records of version 1 have no
+ *     nanoseconds and fill number.
+ *
+ * trades (hash), trade_times (sorted_set), user_trades@[USER] (sorted_set):
+ *     The indexes of the trades. trades maps the ID of each trade, taken
+ *     from trade_ids (string), to its record as in matched_trades.
+ *     trade_times has the ID of every trade, and user_trades@USER has the
+ *     IDs of the trades USER bid or asked in, all scored by their
+ *     timestamps, so the trades of a time range, of a user or not, are one
+ *     ZREVRANGEBYSCORE. The IDs are zero-padded to 16 digits, so that the
+ *     trades of the same second, which tie on the score, sort by ID.
+ *     trade_users (set) has every such USER.
+ *
+ * candles@[INTERVAL] (sorted_set):
+ *     The OHLCV candles of the trades for INTERVAL of 1, 60, and 3600
+ *     seconds, kept up to date by each trade. Each member is "START OPEN
+ *     HIGH LOW CLOSE VOLUME TRADES" for the bucket of INTERVAL seconds from
+ *     the timestamp START, and its score is START, so a range of candles is
+ *     one ZRANGEBYSCORE. A trade is charted at its ask price.
+ *
+ * These keys belong to the default book. The book of a symbol such as
+ * BTCUSD has the same keys prefixed with "{BTCUSD}:", e.g.,
+ * {BTCUSD}:bid_prices.
  */
 
+#define _GNU_SOURCE     /* accept4() */
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <hiredis/hiredis.h>
+#include <hiredis/async.h>
 #include <json-c/json.h>
 
-static redisContext *context;
+#include "address.h"
+
+/*
+ * With --workers, every thread has its own connection and book state, so
+ * the variables of the current command are thread-local.
+ */
+static __thread redisContext *context;
+
+/* where the result of the current command is printed */
+static __thread FILE *output;
+
+/* --pipeline: defer replies of write commands until flush_commands() */
+static __thread int pipelined = 0;
+
+/* number of queued commands whose replies have not been read yet */
+static __thread int pending = 0;
+
+/* --lua: run match() as a server-side script */
+static int lua_match = 0;
+
+/* --memory: keep the book in this process and write behind to Redis */
+static int in_memory = 0;
+
+/* --auto-match: match each order against the other side on arrival */
+static int auto_match = 0;
+
+/* --publish: publish every change of a level and every trade to market */
+static int publish = 0;
+
+/* --workers: number of worker threads, 0 to run commands in main() */
+static int n_workers = 0;
+
+/* --async: let serve send commands on async_context without waiting */
+static int async_mode = 0;
+static redisAsyncContext *async_context;
+
+/* number of commands on async_context whose replies have not arrived */
+static int async_pending = 0;
+
+/* the serve request whose commands go to async_context, or NULL */
+static __thread struct request *async_request;
+
+/* --redis: where Redis listens, a path containing '/' for a Unix socket,
+   [HOST:]PORT otherwise */
+static const char *redis_address = "127.0.0.1:6379";
+
+/* --timeout: the connect and command timeout in milliseconds, 0 for none */
+static long redis_timeout_ms = 0;
+
+/* --replica: replicas of Redis to read list, depth, history, and candles
+   from, in turns */
+#define MAX_REPLICAS 8
+static const char *replica_addresses[MAX_REPLICAS];
+static int n_replicas = 0;
+
+/* --max-lag: seconds a replica may go without hearing from its primary
+   before its reads go back to the primary, -1 for no bound */
+static int replica_max_lag = -1;
+
+/* side_name[0]: bids, side_name[1]: asks */
+static const char *side_name[2] = {"bid", "ask"};
+
+#define MAX_SYMBOL 32
+
+/* symbol of the current book, "" for the default book */
+static __thread char symbol[MAX_SYMBOL + 1] = "";
+
+/* prefix of the keys of the current book: "" for the default book, and
+   "{SYMBOL}:" for the book of SYMBOL, so that all of its keys hash to the
+   same Redis Cluster slot */
+static __thread char key_prefix[MAX_SYMBOL + 4] = "";
+
+/* key_prefix followed by side_name[0] and side_name[1] */
+static __thread char side_key[2][MAX_SYMBOL + 8] = {"bid", "ask"};
+
+/* --compact: stream JSON without spaces instead of building a json-c tree */
+static int compact = 0;
+
+/* --numbers: write counts, prices, amounts, and timestamps as JSON numbers */
+static int numbers = 0;
+
+/* --binary: read messages instead of lines from stdin and serve clients */
+static int binary = 0;
+
+/* maximum number of replies left unread in pipelined mode */
+#define PIPELINE_MAX 1024
+
+/* the longest user name, which fits the length byte of a trade record */
+#define MAX_USER 255
+
+/* prices and amounts are integers in units of 1 / FIXED_ONE */
+#define FIXED_DIGITS 8
+#define FIXED_ONE 100000000LL
+
+/* prices and amounts stay below 2^53, so that Redis scores and Lua numbers,
+   which are doubles, hold them exactly */
+#define FIXED_MAX (1LL << 53)
+
+/*
+ * A Lua script run with EVALSHA. sha is empty until the script is loaded,
+ * and generation tells on which connection it was, see script_sha().
+ */
+struct script {
+    const char *source;
+    char sha[41];
+    int generation;
+};
+
+/*
+ * Parse a non-negative decimal number such as "7902.4" into a fixed-point
+ * number without going through floating point.
+ *
+ * str[0 .. len - 1]: the number, not necessarily null-terminated
+ * return: 0 on success, -1 if str is not such a number, has more than
+ *         FIXED_DIGITS decimals, or is not below FIXED_MAX
+ */
+static int parse_fixed(const char *str, size_t len, long long *value)
+{
+    const char *end = str + len;
+    long long v = 0;
+    int digits = 0, frac = -1;
+
+    for (; str < end; str++) {
+        if (*str == '.' && frac < 0) {
+            frac = 0;
+        } else if (isdigit((unsigned char)*str)) {
+            if (frac >= FIXED_DIGITS) return -1;
+            v = v * 10 + (*str - '0');
+            if (v >= FIXED_MAX) return -1;
+            digits++;
+            if (frac >= 0) frac++;
+        } else {
+            return -1;
+        }
+    }
+    if (digits == 0) return -1;
+    for (frac = frac < 0 ? 0 : frac; frac < FIXED_DIGITS; frac++) {
+        v *= 10;
+        if (v >= FIXED_MAX) return -1;
+    }
+    *value = v;
+    return 0;
+}
+
+/*
+ * Parse a decimal integer from min to max, such as N of depth.
+ *
+ * return: 0 on success, -1 if str is not such a number
+ */
+static int parse_int(const char *str, long min, long max, int *value)
+{
+    char *end;
+    long v = strtol(str, &end, 10);
+
+    if (end == str || *end != '\0' || v < min || v > max) return -1;
+    *value = v;
+    return 0;
+}
+
+/*
+ * Format a fixed-point number with the given number of decimals, rounding
+ * half away from zero, e.g., 790240000000 with 2 decimals is "7902.40".
+ */
+static void format_fixed(char *str, size_t size, long long value,
+                         int decimals)
+{
+    long long scale = FIXED_ONE, v;
+    int i;
+
+    if (decimals < 0 || decimals > FIXED_DIGITS) decimals = FIXED_DIGITS;
+    for (i = decimals; i < FIXED_DIGITS; i++) scale /= 10;
+    v = value < 0 ? -value : value;
+    v = (v + FIXED_ONE / scale / 2) / (FIXED_ONE / scale);
+    if (decimals > 0) {
+        snprintf(str, size, "%s%lld.%0*lld", value < 0 ? "-" : "",
+                 v / scale, decimals, v % scale);
+    } else {
+        snprintf(str, size, "%s%lld", value < 0 ? "-" : "", v);
+    }
+}
+
+/*
+ * return: the integer in a string reply, or 0 for a nil reply
+ */
+static inline long long get_reply_int(redisReply *reply)
+{
+    if (reply->type != REDIS_REPLY_STRING) return 0;
+    return strtoll(reply->str, NULL, 10);
+}
+
+/*
+ * Arena
+ *
+ * The scratch memory of a command, such as the price arrays of match() and
+ * the argument vectors of batched writes, is taken from a per-thread arena
+ * of chunks and given back all at once when the command is done, instead
+ * of going through malloc() and free() piece by piece. The chunks are kept
+ * for the next command, so a server in a steady state does not allocate
+ * for them at all.
+ */
+
+#define ARENA_CHUNK (1 << 16)
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size, used;
+    max_align_t data[];
+};
+
+/* what arena_release() rolls back to */
+struct arena_mark {
+    struct arena_chunk *chunk;
+    size_t used;
+};
+
+/* the chunks kept, and the one allocated from, or NULL before the first */
+static __thread struct arena_chunk *arena_first, *arena_current;
+
+/*
+ * return: size bytes aligned for any type, valid until the arena is
+ *         released past them
+ */
+static void *arena_alloc(size_t size)
+{
+    struct arena_chunk *chunk = arena_current, **link;
+    const size_t align = sizeof(max_align_t);
+
+    size = (size + align - 1) / align * align;
+    if (chunk && chunk->size - chunk->used >= size) {
+        chunk->used += size;
+        return (char *)chunk->data + chunk->used - size;
+    }
+    /* the next chunk kept from before that is large enough, or a new one */
+    link = chunk ? &chunk->next : &arena_first;
+    while (*link && (*link)->size < size) link = &(*link)->next;
+    if (*link == NULL) {
+        size_t n = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        *link = malloc(sizeof(struct arena_chunk) + n);
+        (*link)->next = NULL;
+        (*link)->size = n;
+    }
+    chunk = arena_current = *link;
+    chunk->used = size;
+    return chunk->data;
+}
+
+static struct arena_mark arena_mark()
+{
+    struct arena_mark mark = {
+        arena_current, arena_current ? arena_current->used : 0
+    };
+    return mark;
+}
+
+/*
+ * Give back everything allocated since mark, in O(1).
+ */
+static void arena_release(struct arena_mark mark)
+{
+    arena_current = mark.chunk;
+    if (mark.chunk) mark.chunk->used = mark.used;
+}
+
+/*
+ * JSON Output
+ *
+ * Results are written through the out_*() functions below. By default they
+ * build a json-c tree, which out_finish() prints pretty. With --compact,
+ * they stream straight into out_buf instead, without any allocation.
+ * Every function taking a key ignores it inside an array.
+ */
+
+#define OUT_DEPTH 8
+
+static __thread json_object *out_tree[OUT_DEPTH];
+static __thread char out_buf[65536];
+static __thread size_t out_len;
+static __thread int out_first[OUT_DEPTH];   /* nothing written at this level yet */
+static __thread int out_array[OUT_DEPTH];   /* this level is an array */
+static __thread int out_level = -1;
+
+static inline void out_write(const char *str, size_t len)
+{
+    if (out_len + len > sizeof(out_buf)) {
+        fwrite(out_buf, 1, out_len, output);
+        out_len = 0;
+        if (len > sizeof(out_buf)) {
+            fwrite(str, 1, len, output);
+            return;
+        }
+    }
+    memcpy(out_buf + out_len, str, len);
+    out_len += len;
+}
+
+static inline void out_char(char c)
+{
+    if (out_len == sizeof(out_buf)) {
+        fwrite(out_buf, 1, out_len, output);
+        out_len = 0;
+    }
+    out_buf[out_len++] = c;
+}
+
+static void out_uint(unsigned long long v)
+{
+    char s[20];
+    int i = sizeof(s);
+
+    do s[--i] = '0' + v % 10; while (v /= 10);
+    out_write(s + i, sizeof(s) - i);
+}
+
+static void out_quoted(const char *str, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+
+    out_char('"');
+    for (i = 0; i < len; i++) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            out_char('\\');
+            out_char(c);
+        } else if (c < 0x20) {
+            out_write("\\u00", 4);
+            out_char(hex[c >> 4]);
+            out_char(hex[c & 15]);
+        } else {
+            out_char(c);
+        }
+    }
+    out_char('"');
+}
+
+/*
+ * Write the separator and the key before a value in compact mode.
+ */
+static void out_key(const char *key)
+{
+    if (out_level < 0) return;
+    if (!out_first[out_level]) out_char(',');
+    out_first[out_level] = 0;
+    if (!out_array[out_level]) {
+        out_quoted(key, strlen(key));
+        out_char(':');
+    }
+}
+
+/*
+ * Add value to the innermost json-c object or array.
+ */
+static void out_add(const char *key, json_object *value)
+{
+    if (out_level < 0) {
+        out_tree[0] = value;
+    } else if (out_array[out_level]) {
+        json_object_array_add(out_tree[out_level], value);
+    } else {
+        json_object_object_add(out_tree[out_level], key, value);
+    }
+}
+
+static void out_begin(const char *key, int array)
+{
+    if (compact) {
+        out_key(key);
+        out_char(array ? '[' : '{');
+    } else {
+        json_object *value = array ? json_object_new_array()
+                                   : json_object_new_object();
+        out_add(key, value);
+        out_tree[out_level + 1] = value;
+    }
+    out_level++;
+    out_first[out_level] = 1;
+    out_array[out_level] = array;
+}
+
+static inline void out_begin_object(const char *key)
+{
+    out_begin(key, 0);
+}
+
+static inline void out_begin_array(const char *key)
+{
+    out_begin(key, 1);
+}
+
+static void out_end()
+{
+    if (compact) out_char(out_array[out_level] ? ']' : '}');
+    out_level--;
+}
+
+static void out_string(const char *key, const char *str, size_t len)
+{
+    if (compact) {
+        out_key(key);
+        out_quoted(str, len);
+    } else {
+        out_add(key, json_object_new_string_len(str, len));
+    }
+}
+
+static void out_null(const char *key)
+{
+    if (compact) {
+        out_key(key);
+        out_write("null", 4);
+    } else {
+        out_add(key, NULL);
+    }
+}
+
+/*
+ * Write an integer as a number.
+ */
+static void out_int(const char *key, long long value)
+{
+    if (compact) {
+        out_key(key);
+        if (value < 0) out_char('-');
+        out_uint(value < 0 ? -(unsigned long long)value : value);
+    } else {
+        out_add(key, json_object_new_int64(value));
+    }
+}
+
+/*
+ * Write an integer as a string, or as a number with --numbers.
+ */
+static void out_count(const char *key, long long value)
+{
+    char s[24];
+
+    if (compact) {
+        out_key(key);
+        if (!numbers) out_char('"');
+        if (value < 0) out_char('-');
+        out_uint(value < 0 ? -(unsigned long long)value : value);
+        if (!numbers) out_char('"');
+    } else {
+        snprintf(s, sizeof(s), "%lld", value);
+        out_add(key, numbers ? json_object_new_int64(value)
+                             : json_object_new_string(s));
+    }
+}
+
+/*
+ * Write a fixed-point number with 2 decimals as a string, or as a number
+ * with --numbers.
+ */
+static void out_fixed(const char *key, long long value)
+{
+    const long long unit = FIXED_ONE / 100;
+    char s[24];
+
+    if (compact) {
+        unsigned long long v = value < 0 ? -(unsigned long long)value : value;
+        v = (v + unit / 2) / unit;
+        out_key(key);
+        if (!numbers) out_char('"');
+        if (value < 0) out_char('-');
+        out_uint(v / 100);
+        out_char('.');
+        out_char('0' + v / 10 % 10);
+        out_char('0' + v % 10);
+        if (!numbers) out_char('"');
+    } else {
+        format_fixed(s, sizeof(s), value, 2);
+        out_add(key, numbers ? json_object_new_double_s(
+                                   (double)value / FIXED_ONE, s)
+                             : json_object_new_string(s));
+    }
+}
+
+/*
+ * Print the result written since the last call.
+ */
+static void out_finish()
+{
+    if (compact) {
+        out_char('\n');
+        fwrite(out_buf, 1, out_len, output);
+        out_len = 0;
+    } else {
+        fprintf(output, "%s\n",
+                json_object_to_json_string_ext(out_tree[0],
+                                               JSON_C_TO_STRING_PRETTY));
+        json_object_put(out_tree[0]);
+    }
+    out_level = -1;
+}
+
+/*
+ * Statistics (stats, --metrics)
+ *
+ * Each high-level operation counts its calls, the Redis commands and round
+ * trips made while it runs, including those of the operations it calls,
+ * e.g., the trades of a match, and its latencies in a log-linear histogram
+ * like HdrHistogram's: HIST_SUB buckets for each power of 2 nanoseconds,
+ * which keeps every percentile within 1 / HIST_SUB. The counters are
+ * shared by all the threads.
+ */
+
+enum {
+    STAT_BID_ASK, STAT_AMEND, STAT_TRADE, STAT_MATCH, STAT_LIST, STAT_DEPTH,
+    STAT_HISTORY, STAT_CANDLES, STAT_CLEAR, STAT_LOAD, N_STATS
+};
+
+static const char *stat_name[N_STATS] = {
+    "bid_ask", "amend", "trade", "match", "list", "depth", "history",
+    "candles", "clear", "load"
+};
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct op_stats {
+    atomic_llong calls, commands, round_trips, total_ns, max_ns;
+    atomic_llong hist[HIST_BUCKETS];
+};
+
+static struct op_stats op_stats[N_STATS];
+
+/* bit STAT_* is set while that operation runs in this thread */
+static __thread unsigned stat_active;
+
+/* commands were written since the last round trip */
+static __thread int unsent;
+
+static long long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Add commands and round_trips to the operations running.
+ */
+static void count_commands(int commands, int round_trips)
+{
+    unsigned active = stat_active;
+
+    while (active) {
+        struct op_stats *st = &op_stats[__builtin_ctz(active)];
+        atomic_fetch_add_explicit(&st->commands, commands,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&st->round_trips, round_trips,
+                                  memory_order_relaxed);
+        active &= active - 1;
+    }
+}
+
+/*
+ * Count a round trip if commands were written since the last one, as
+ * hiredis sends them all before it waits for the first reply.
+ */
+static inline void count_round_trip()
+{
+    if (unsent) {
+        count_commands(0, 1);
+        unsent = 0;
+    }
+}
+
+/*
+ * Start operation op.
+ *
+ * return: the start time for stat_end(), or 0 if op is already running
+ */
+static long long stat_begin(int op)
+{
+    if (stat_active & 1u << op) return 0;
+    stat_active |= 1u << op;
+    return now_ns();
+}
+
+static int hist_bucket(unsigned long long ns)
+{
+    int e;
+
+    if (ns < HIST_SUB) return ns;
+    e = 63 - __builtin_clzll(ns);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+           (int)(ns >> (e - HIST_SUB_BITS)) - HIST_SUB;
+}
+
+/*
+ * return: the middle of bucket i in nanoseconds
+ */
+static long long hist_value(int i)
+{
+    int e = i / HIST_SUB + HIST_SUB_BITS - 1;
+    long long low;
+
+    if (i < HIST_SUB) return i;
+    low = (long long)(i % HIST_SUB + HIST_SUB) << (e - HIST_SUB_BITS);
+    return low + ((1LL << (e - HIST_SUB_BITS)) >> 1);
+}
+
+/*
+ * Finish operation op started at start by stat_begin().
+ */
+static void stat_end(int op, long long start)
+{
+    struct op_stats *st = &op_stats[op];
+    long long ns, max;
+
+    if (start == 0) return;
+    ns = now_ns() - start;
+    stat_active &= ~(1u << op);
+    atomic_fetch_add_explicit(&st->calls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->total_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->hist[hist_bucket(ns)], 1,
+                              memory_order_relaxed);
+    max = atomic_load_explicit(&st->max_ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(
+               &st->max_ns, &max, ns, memory_order_relaxed,
+               memory_order_relaxed));
+}
+
+/*
+ * hist[0 .. HIST_BUCKETS - 1]: a copy of the histogram of calls calls
+ * return: the latency at quantile q in nanoseconds
+ */
+static long long hist_quantile(const long long *hist, long long calls,
+                               double q)
+{
+    long long rank = (long long)(q * calls), seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank) return hist_value(i);
+    }
+    return 0;
+}
+
+struct stat_summary {
+    long long calls, commands, round_trips, total_ns, max_ns;
+    long long p50, p99, p999;
+};
+
+static void summarize(int op, struct stat_summary *sum)
+{
+    struct op_stats *st = &op_stats[op];
+    long long hist[HIST_BUCKETS];
+    int i;
+
+    sum->calls = 0;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        hist[i] = atomic_load_explicit(&st->hist[i], memory_order_relaxed);
+        sum->calls += hist[i];
+    }
+    sum->commands = atomic_load_explicit(&st->commands, memory_order_relaxed);
+    sum->round_trips = atomic_load_explicit(&st->round_trips,
+                                            memory_order_relaxed);
+    sum->total_ns = atomic_load_explicit(&st->total_ns, memory_order_relaxed);
+    sum->max_ns = atomic_load_explicit(&st->max_ns, memory_order_relaxed);
+    sum->p50 = hist_quantile(hist, sum->calls, 0.5);
+    sum->p99 = hist_quantile(hist, sum->calls, 0.99);
+    sum->p999 = hist_quantile(hist, sum->calls, 0.999);
+    /* the middle of the last bucket can be past the slowest call */
+    if (sum->p50 > sum->max_ns) sum->p50 = sum->max_ns;
+    if (sum->p99 > sum->max_ns) sum->p99 = sum->max_ns;
+    if (sum->p999 > sum->max_ns) sum->p999 = sum->max_ns;
+}
+
+/*
+ * Write the statistics of all the operations called so far as JSON.
+ */
+static void stats()
+{
+    struct stat_summary sum;
+    int op;
+
+    out_begin_object(NULL);
+    for (op = 0; op < N_STATS; op++) {
+        summarize(op, &sum);
+        out_begin_object(stat_name[op]);
+        out_int("calls", sum.calls);
+        out_int("commands", sum.commands);
+        out_int("round_trips", sum.round_trips);
+        out_int("p50_ns", sum.p50);
+        out_int("p99_ns", sum.p99);
+        out_int("p999_ns", sum.p999);
+        out_int("max_ns", sum.max_ns);
+        out_end();
+    }
+    out_end();
+    out_finish();
+}
+
+/*
+ * Write the statistics in the Prometheus text format.
+ */
+static void write_metrics(FILE *fp)
+{
+    static const char *counter[3][2] = {
+        {"book_calls_total", "Calls of each operation."},
+        {"book_redis_commands_total", "Redis commands sent by each operation."},
+        {"book_redis_round_trips_total",
+         "Redis round trips waited for by each operation."}
+    };
+    struct stat_summary sum[N_STATS];
+    int op, i;
+
+    for (op = 0; op < N_STATS; op++) summarize(op, &sum[op]);
+    for (i = 0; i < 3; i++) {
+        fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n", counter[i][0],
+                counter[i][1], counter[i][0]);
+        for (op = 0; op < N_STATS; op++) {
+            fprintf(fp, "%s{op=\"%s\"} %lld\n", counter[i][0], stat_name[op],
+                    i == 0 ? sum[op].calls : i == 1 ? sum[op].commands
+                                                    : sum[op].round_trips);
+        }
+    }
+    fputs("# HELP book_latency_seconds Latency of each operation.\n"
+          "# TYPE book_latency_seconds summary\n", fp);
+    for (op = 0; op < N_STATS; op++) {
+        const char *name = stat_name[op];
+        fprintf(fp, "book_latency_seconds{op=\"%s\",quantile=\"0.5\"} %.9f\n"
+                "book_latency_seconds{op=\"%s\",quantile=\"0.99\"} %.9f\n"
+                "book_latency_seconds{op=\"%s\",quantile=\"0.999\"} %.9f\n"
+                "book_latency_seconds_sum{op=\"%s\"} %.9f\n"
+                "book_latency_seconds_count{op=\"%s\"} %lld\n",
+                name, sum[op].p50 / 1e9, name, sum[op].p99 / 1e9,
+                name, sum[op].p999 / 1e9, name, sum[op].total_ns / 1e9,
+                name, sum[op].calls);
+    }
+}
+
+/*
+ * A script command queued by script_command(), kept until its reply is
+ * read, so that it can be sent again if the server did not have the script.
+ */
+struct queued_script {
+    int index;              /* its reply follows those of index commands */
+    struct script *script;
+    char *cmd;              /* as formatted by hiredis */
+    long long len;
+    int retried;
+};
+
+struct script_queue {
+    struct queued_script *items;
+    int n, size;
+};
+
+/* the script commands among the pending ones, in order */
+static __thread struct script_queue queued_scripts;
+
+/* commands of append_command() whose replies get_reply() has not read */
+static __thread int appended;
+
+/* bumped on every new connection, which has none of the scripts loaded */
+static __thread int script_generation;
+
+static void load_script(struct script *script);
+
+static int is_noscript(redisReply *reply)
+{
+    return reply && reply->type == REDIS_REPLY_ERROR &&
+           strncmp(reply->str, "NOSCRIPT", 8) == 0;
+}
+
+/*
+ * Append the formatted script command cmd, which is freed once its reply
+ * is read.
+ */
+static void queue_script(struct script *script, char *cmd, long long len,
+                         int retried)
+{
+    struct script_queue *q = &queued_scripts;
+
+    if (q->n == q->size) {
+        q->size = q->size ? 2 * q->size : 16;
+        q->items = realloc(q->items, q->size * sizeof(*q->items));
+    }
+    q->items[q->n++] = (struct queued_script){pending, script, cmd, len,
+                                              retried};
+    redisAppendFormattedCommand(context, cmd, len);
+    count_commands(1, 0);
+    unsent = 1;
+    pending++;
+}
+
+static void free_script_queue(struct script_queue *q)
+{
+    int i;
+
+    for (i = 0; i < q->n; i++) free(q->items[i].cmd);
+    free(q->items);
+    memset(q, 0, sizeof(*q));
+}
+
+/*
+ * Read and discard the replies of all commands queued by command(). The
+ * script commands that failed with NOSCRIPT are sent again once, after a
+ * SCRIPT LOAD of their scripts. If replies of append_command() are waiting
+ * behind them, they are left for get_reply(), and the replies of the
+ * commands sent again for the next flush_commands().
+ */
+static void flush_commands()
+{
+    struct script_queue queue;
+    redisReply *reply;
+    int i, j, k, n;
+
+    while (pending > 0) {
+        count_round_trip();
+        queue = queued_scripts;
+        memset(&queued_scripts, 0, sizeof(queued_scripts));
+        for (n = pending, i = j = 0; i < n; i++, pending--) {
+            if (redisGetReply(context, (void **)&reply) != REDIS_OK) {
+                reply = NULL;
+            }
+            if (j < queue.n && queue.items[j].index == i) {
+                struct queued_script *item = &queue.items[j++];
+                if (!item->retried && is_noscript(reply)) {
+                    item->retried = 1;
+                } else {
+                    if (reply && reply->type == REDIS_REPLY_ERROR) {
+                        fprintf(stderr, "EVALSHA: %s\n", reply->str);
+                    }
+                    free(item->cmd);
+                    item->cmd = NULL;
+                }
+            }
+            if (reply) freeReplyObject(reply);
+        }
+
+        /* each script once, before the commands that wait for it */
+        for (j = 0; j < queue.n; j++) {
+            struct script *script = queue.items[j].script;
+            if (queue.items[j].cmd == NULL) continue;
+            for (k = 0; k < j; k++) {
+                if (queue.items[k].cmd && queue.items[k].script == script) {
+                    break;
+                }
+            }
+            if (k < j) continue;
+            redisAppendCommand(context, "SCRIPT LOAD %s", script->source);
+            count_commands(1, 0);
+            unsent = 1;
+            pending++;
+            script->generation = script_generation;
+        }
+        for (j = 0; j < queue.n; j++) {
+            if (queue.items[j].cmd == NULL) continue;
+            queue_script(queue.items[j].script, queue.items[j].cmd,
+                         queue.items[j].len, 1);
+        }
+        free(queue.items);
+        if (appended > 0) break;
+    }
+}
+
+static void async_write_sent();
+static void async_write_done(struct request *req, redisReply *reply);
+
+/*
+ * Take the reply of a command() sent on async_context for the request
+ * privdata, which is answered once all of its writes are.
+ */
+static void async_discard(redisAsyncContext *ac, void *reply, void *privdata)
+{
+    async_write_done(privdata, reply);
+}
+
+/*
+ * A script command sent on async_context, kept until its reply arrives.
+ */
+struct async_script {
+    struct script *script;
+    redisCallbackFn *fn;
+    void *privdata;
+    char *cmd;              /* as formatted by hiredis */
+    long long len;
+    int retried;
+};
+
+/*
+ * Pass the reply of a script command to its callback, unless the server
+ * did not have the script: then load it and send the command once more.
+ */
+static void async_script_reply(redisAsyncContext *ac, void *reply,
+                               void *privdata)
+{
+    struct async_script *s = privdata;
+
+    if (!s->retried && is_noscript(reply)) {
+        s->retried = 1;
+        if (redisAsyncCommand(ac, NULL, NULL, "SCRIPT LOAD %s",
+                              s->script->source) == REDIS_OK &&
+            redisAsyncFormattedCommand(ac, async_script_reply, s, s->cmd,
+                                       s->len) == REDIS_OK) {
+            return;
+        }
+    }
+    s->fn(ac, reply, s->privdata);
+    free(s->cmd);
+    free(s);
+}
+
+/*
+ * Send the formatted script command cmd on async_context, and pass its
+ * reply to fn.
+ */
+static void send_async_script(struct script *script, redisCallbackFn *fn,
+                              void *privdata, char *cmd, long long len)
+{
+    struct async_script *s = malloc(sizeof(*s));
+
+    *s = (struct async_script){script, fn, privdata, cmd, len, 0};
+    redisAsyncFormattedCommand(async_context, async_script_reply, s, cmd, len);
+}
+
+/*
+ * Queue a command whose reply is not needed. In pipelined mode the command
+ * stays in the output buffer until the next flush_commands() or query(), so
+ * that a whole order or trade step costs a single round trip. Otherwise, it
+ * is sent and its reply is read immediately.
+ */
+static void command(const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    if (async_request) {
+        /* answered by async_discard() as the event loop goes on */
+        redisvAsyncCommand(async_context, async_discard, async_request,
+                           format, ap);
+        va_end(ap);
+        async_write_sent();
+        count_commands(1, 0);
+        return;
+    }
+    redisvAppendCommand(context, format, ap);
+    va_end(ap);
+    count_commands(1, 0);
+    unsent = 1;
+    pending++;
+    if (!pipelined || pending >= PIPELINE_MAX) flush_commands();
+}
+
+/*
+ * Same as command() with the arguments given as binary-safe strings.
+ */
+static void command_argv(int argc, const char **argv, const size_t *argvlen)
+{
+    if (async_request) {
+        redisAsyncCommandArgv(async_context, async_discard, async_request,
+                              argc, argv, argvlen);
+        async_write_sent();
+        count_commands(1, 0);
+        return;
+    }
+    redisAppendCommandArgv(context, argc, argv, argvlen);
+    count_commands(1, 0);
+    unsent = 1;
+    pending++;
+    if (!pipelined || pending >= PIPELINE_MAX) flush_commands();
+}
+
+/*
+ * Queue a command whose reply will be fetched by get_reply() after
+ * flush_commands().
+ */
+static void append_command(const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    redisvAppendCommand(context, format, ap);
+    va_end(ap);
+    count_commands(1, 0);
+    unsent = 1;
+    appended++;
+}
+
+/*
+ * Same as append_command() with the arguments given as binary-safe strings.
+ */
+static void append_command_argv(int argc, const char **argv,
+                                const size_t *argvlen)
+{
+    redisAppendCommandArgv(context, argc, argv, argvlen);
+    count_commands(1, 0);
+    unsent = 1;
+    appended++;
+}
+
+/*
+ * return: an error reply in place of the one lost with the connection, so
+ *         that callers only have to check its type
+ */
+static redisReply *connection_error()
+{
+    redisReply *reply = calloc(1, sizeof(*reply));
+
+    reply->type = REDIS_REPLY_ERROR;
+    reply->str = strdup(context->errstr[0] ? context->errstr
+                                           : "connection lost");
+    reply->len = strlen(reply->str);
+    return reply;
+}
+
+static redisReply *get_reply()
+{
+    redisReply *reply = NULL;
+
+    count_round_trip();
+    if (appended > 0) appended--;
+    if (redisGetReply(context, (void **)&reply) != REDIS_OK) {
+        return connection_error();
+    }
+    return reply;
+}
+
+/*
+ * Send a command and wait for its reply. Commands queued before are sent
+ * first.
+ */
+static redisReply *query(const char *format, ...)
+{
+    va_list ap;
+    redisReply *reply;
+
+    flush_commands();
+    /* with the commands appended before it, if any */
+    count_commands(1, 1);
+    unsent = 0;
+    va_start(ap, format);
+    reply = redisvCommand(context, format, ap);
+    va_end(ap);
+    return reply ? reply : connection_error();
+}
+
+static void load_script(struct script *script)
+{
+    redisReply *reply = query("SCRIPT LOAD %s", script->source);
+    if (reply->type == REDIS_REPLY_STRING && reply->len < sizeof(script->sha)) {
+        memcpy(script->sha, reply->str, reply->len);
+        script->sha[reply->len] = '\0';
+        script->generation = script_generation;
+    } else {
+        fprintf(stderr, "SCRIPT LOAD: %s\n",
+                reply->type == REDIS_REPLY_ERROR ? reply->str : "bad reply");
+    }
+    freeReplyObject(reply);
+}
+
+/*
+ * return: the SHA1 digest of script, which is loaded first unless it has
+ *         been on this connection, as a Redis that restarted has lost it
+ */
+static const char *script_sha(struct script *script)
+{
+    if (script->sha[0] == '\0' || script->generation != script_generation) {
+        load_script(script);
+    }
+    return script->sha;
+}
+
+/*
+ * Run a script and wait for its reply. format gives numkeys and the
+ * arguments following the SHA1 digest. The script is loaded on first use,
+ * after a reconnect, and again if the server has lost it.
+ */
+static redisReply *eval_script(struct script *script, const char *format, ...)
+{
+    char cmd[128];
+    va_list ap;
+    redisReply *reply;
+    int retry;
+
+    for (retry = 0; ; retry++) {
+        if (retry) load_script(script);
+        snprintf(cmd, sizeof(cmd), "EVALSHA %s %s", script_sha(script),
+                 format);
+        flush_commands();
+        count_commands(1, 1);
+        unsent = 0;
+        va_start(ap, format);
+        reply = redisvCommand(context, cmd, ap);
+        va_end(ap);
+        if (reply == NULL) return connection_error();
+        if (retry == 0 && is_noscript(reply)) {
+            freeReplyObject(reply);
+            continue;
+        }
+        return reply;
+    }
+}
+
+/*
+ * Send a formatted script command like command() does.
+ */
+static void send_script(struct script *script, char *cmd, long long len)
+{
+    if (len < 0) return;
+    if (async_request) {
+        send_async_script(script, async_discard, async_request, cmd, len);
+        async_write_sent();
+        count_commands(1, 0);
+        return;
+    }
+    queue_script(script, cmd, len, 0);
+    if (!pipelined || pending >= PIPELINE_MAX) flush_commands();
+}
+
+/*
+ * Same as command() for a script, whose SHA1 digest goes before format. A
+ * script the server has lost is loaded and run again by flush_commands().
+ */
+static void script_command(struct script *script, const char *format, ...)
+{
+    char fmt[160];
+    char *cmd;
+    long long len;
+    va_list ap;
+
+    snprintf(fmt, sizeof(fmt), "EVALSHA %s %s", script_sha(script), format);
+    va_start(ap, format);
+    len = redisvFormatCommand(&cmd, fmt, ap);
+    va_end(ap);
+    send_script(script, cmd, len);
+}
+
+/*
+ * Same as script_command() with the arguments given as binary-safe
+ * strings from argv[2] on. argv[0] and argv[1] are set to EVALSHA and the
+ * SHA1 digest.
+ */
+static void script_command_argv(struct script *script, int argc,
+                                const char **argv, size_t *argvlen)
+{
+    char *cmd;
+    long long len;
+
+    argv[0] = "EVALSHA";
+    argvlen[0] = 7;
+    argv[1] = script_sha(script);
+    argvlen[1] = strlen(argv[1]);
+    len = redisFormatCommandArgv(&cmd, argc, argv, argvlen);
+    send_script(script, cmd, len);
+}
+
+/*
+ * Same as redisAsyncCommand() for a script, whose SHA1 digest goes before
+ * format, and which is loaded and run again if the server has lost it.
+ */
+static void async_script_command(struct script *script, redisCallbackFn *fn,
+                                 void *privdata, const char *format, ...)
+{
+    char fmt[160];
+    char *cmd;
+    long long len;
+    va_list ap;
+
+    snprintf(fmt, sizeof(fmt), "EVALSHA %s %s", script_sha(script), format);
+    va_start(ap, format);
+    len = redisvFormatCommand(&cmd, fmt, ap);
+    va_end(ap);
+    if (len >= 0) send_async_script(script, fn, privdata, cmd, len);
+}
+
+/*
+ * A trade as stored in matched_trades. The names point into the packed
+ * record and are not null-terminated.
+ */
+struct trade {
+    long long bid_price, ask_price, amount;
+    long long timestamp;    /* in nanoseconds since the epoch */
+    int fill;               /* the number of the trade in its match cycle */
+    const char *bidder, *asker;
+    size_t bidder_len, asker_len;
+};
+
+#define TRADE_RECORD_VERSION 2
+#define TRADE_RECORD_MAX (1 + 4 * 8 + 2 * 4 + 2 * (1 + MAX_USER))
+
+#define NS_PER_SEC 1000000000LL
+
+static char *pack_int(char *p, long long value)
+{
+    unsigned long long v = value;
+    int i;
+
+    for (i = 0; i < 8; i++, v >>= 8) *p++ = v & 0xff;
+    return p;
+}
+
+static const char *unpack_int(const char *p, long long *value)
+{
+    unsigned long long v = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--) v = v << 8 | (unsigned char)p[i];
+    *value = v;
+    return p + 8;
+}
+
+static char *pack_int32(char *p, unsigned value)
+{
+    int i;
+
+    for (i = 0; i < 4; i++, value >>= 8) *p++ = value & 0xff;
+    return p;
+}
+
+static const char *unpack_int32(const char *p, unsigned *value)
+{
+    int i;
+
+    for (*value = 0, i = 3; i >= 0; i--) {
+        *value = *value << 8 | (unsigned char)p[i];
+    }
+    return p + 4;
+}
+
+static char *pack_str(char *p, const char *str, size_t len)
+{
+    *p++ = len;
+    memcpy(p, str, len);
+    return p + len;
+}
+
+/*
+ * buf: at least TRADE_RECORD_MAX bytes
+ * return: the length of the record
+ */
+static size_t pack_trade(char *buf, const struct trade *trade)
+{
+    char *p = buf;
+
+    *p++ = TRADE_RECORD_VERSION;
+    p = pack_int(p, trade->bid_price);
+    p = pack_int(p, trade->ask_price);
+    p = pack_int(p, trade->amount);
+    p = pack_int(p, trade->timestamp / NS_PER_SEC);
+    p = pack_int32(p, trade->timestamp % NS_PER_SEC);
+    p = pack_int32(p, trade->fill);
+    p = pack_str(p, trade->bidder, trade->bidder_len);
+    p = pack_str(p, trade->asker, trade->asker_len);
+    return p - buf;
+}
+
+/*
+ * return: 0 on success, -1 if buf[0 .. len - 1] is not a trade record
+ */
+static int unpack_trade(const char *buf, size_t len, struct trade *trade)
+{
+    const char *p = buf, *end = buf + len;
+    unsigned nanos = 0, fill = 0;
+    int version;
+
+    if (len < 1 + 4 * 8 + 2) return -1;
+    version = *p++;
+    if (version != 1 && (version != 2 || len < 1 + 4 * 8 + 2 * 4 + 2)) {
+        return -1;
+    }
+    p = unpack_int(p, &trade->bid_price);
+    p = unpack_int(p, &trade->ask_price);
+    p = unpack_int(p, &trade->amount);
+    p = unpack_int(p, &trade->timestamp);
+    if (version == 2) {
+        p = unpack_int32(p, &nanos);
+        p = unpack_int32(p, &fill);
+    }
+    trade->timestamp = trade->timestamp * NS_PER_SEC + nanos;
+    trade->fill = fill;
+    trade->bidder_len = (unsigned char)*p++;
+    trade->bidder = p;
+    p += trade->bidder_len;
+    if (p >= end) return -1;
+    trade->asker_len = (unsigned char)*p++;
+    trade->asker = p;
+    p += trade->asker_len;
+    return p == end ? 0 : -1;
+}
+
+/* order IDs are taken from order_ids in blocks of ID_BLOCK, so that most
+   orders need no round trip for theirs */
+#define ID_BLOCK 1024
+
+/* the longest element "ID USER" of a queue, with its '\0' */
+#define ENTRY_MAX (20 + 1 + MAX_USER + 1)
+
+/* the IDs next_id ~ last_id - 1 are allocated to this thread */
+static __thread long long next_id, last_id;
+
+/* bumped by a restore, which drops the blocks of all the threads, as the
+   restored orders may have taken their IDs */
+static atomic_int id_generation;
+static __thread int id_block_generation;
+
+/*
+ * return: a new order ID, or 0 on error
+ */
+static long long new_order_id()
+{
+    int generation = atomic_load(&id_generation);
+    redisReply *reply;
+
+    if (next_id == last_id || id_block_generation != generation) {
+        reply = query("INCRBY order_ids %d", ID_BLOCK);
+        if (reply->type != REDIS_REPLY_INTEGER) {
+            fprintf(stderr, "INCRBY order_ids: %s\n",
+                    reply->type == REDIS_REPLY_ERROR ? reply->str
+                                                     : "bad reply");
+            freeReplyObject(reply);
+            return 0;
+        }
+        last_id = reply->integer + 1;
+        next_id = last_id - ID_BLOCK;
+        id_block_generation = generation;
+        freeReplyObject(reply);
+    }
+    return next_id++;
+}
+
+/*
+ * return: AMOUNT of an HGET reply of orders, or -1 if the order is gone
+ */
+static long long get_order_amount(redisReply *reply)
+{
+    const char *amount;
+
+    if (reply->type != REDIS_REPLY_STRING) return -1;
+    amount = memrchr(reply->str, ' ', reply->len);
+    return amount ? strtoll(amount + 1, NULL, 10) : -1;
+}
+
+/*
+ * Lua functions to publish to market, shared by the scripts below. p is
+ * key_prefix of the book, and side is "bid" or "ask".
+ */
+#define MARKET_LUA \
+    "local function publish(p, msg)\n" \
+    "    redis.call('PUBLISH', p .. 'market',\n" \
+    "               redis.call('INCR', p .. 'market_seq') .. ' ' .. msg)\n" \
+    "end\n" \
+    "local function publish_level(p, side, price)\n" \
+    "    publish(p, string.format('L %s %s %s %s', side, price,\n" \
+    "        redis.call('HGET', p .. side .. '_level_counts', price) or 0,\n" \
+    "        redis.call('HGET', p .. side .. '_level_amounts', price) or 0))\n" \
+    "end\n"
+
+/*
+ * Publish a message to market after the commands before it.
+ *
+ * ARGV[1]: key_prefix of the book
+ * ARGV[2]: "L" to publish the level of side ARGV[3] at price ARGV[4], or
+ *          else the message ARGV[2]
+ */
+static __thread struct script market_script = {
+    MARKET_LUA
+    "if ARGV[2] == 'L' then\n"
+    "    publish_level(ARGV[1], ARGV[3], ARGV[4])\n"
+    "else\n"
+    "    publish(ARGV[1], ARGV[2])\n"
+    "end\n"
+};
+
+/*
+ * Publish the count and the amount of the level of which at price, once the
+ * commands changing it are run.
+ */
+static void publish_level(int which, long long price)
+{
+    if (!publish) return;
+    script_command(&market_script, "0 %s L %s %lld", key_prefix,
+                   side_name[which], price);
+}
+
+/*
+ * Publish msg as it is, e.g., "C".
+ */
+static void publish_message(const char *msg)
+{
+    if (!publish) return;
+    script_command(&market_script, "0 %s %s", key_prefix, msg);
+}
+
+/*
+ * Lua functions to index a trade, whose packed record is record, and to add
+ * it at price to the candles of the book of p, shared by the scripts below.
+ */
+#define TRADE_LUA \
+    "local function index_trade(p, record, bidder, asker, now)\n" \
+    "    local id = string.format('%016d',\n" \
+    "                             redis.call('INCR', p .. 'trade_ids'))\n" \
+    "    redis.call('HSET', p .. 'trades', id, record)\n" \
+    "    redis.call('ZADD', p .. 'trade_times', now, id)\n" \
+    "    redis.call('ZADD', p .. 'user_trades@' .. bidder, now, id)\n" \
+    "    redis.call('ZADD', p .. 'user_trades@' .. asker, now, id)\n" \
+    "    redis.call('SADD', p .. 'trade_users', bidder, asker)\n" \
+    "end\n" \
+    "local function candle(p, price, amount, now)\n" \
+    "    for _, interval in ipairs({1, 60, 3600}) do\n" \
+    "        local key = p .. 'candles@' .. interval\n" \
+    "        local start = now - now % interval\n" \
+    "        local o, h, l, v, n = price, price, price, 0, 0\n" \
+    "        local c = redis.call('ZRANGEBYSCORE', key, start, start)[1]\n" \
+    "        if c then\n" \
+    "            local f = {}\n" \
+    "            for x in string.gmatch(c, '%d+') do\n" \
+    "                f[#f + 1] = tonumber(x)\n" \
+    "            end\n" \
+    "            o, v, n = f[2], f[6], f[7]\n" \
+    "            h, l = math.max(f[3], price), math.min(f[4], price)\n" \
+    "            redis.call('ZREM', key, c)\n" \
+    "        end\n" \
+    "        redis.call('ZADD', key, start,\n" \
+    "                   string.format('%d %d %d %d %d %d %d', start, o, h, l,\n" \
+    "                                 price, v + amount, n + 1))\n" \
+    "    end\n" \
+    "end\n"
+
+/*
+ * Index trades and add them to the candles after the commands before it.
+ *
+ * ARGV[1]: key_prefix of the book
+ * ARGV[2 ..]: the trade records
+ */
+static __thread struct script trade_script = {
+    TRADE_LUA
+    "for i = 2, #ARGV do\n"
+    "    local _, _, ap, amount, now, _, _, bidder, asker =\n"
+    "        struct.unpack('<Bi8i8i8i8I4I4Bc0Bc0', ARGV[i])\n"
+    "    index_trade(ARGV[1], ARGV[i], bidder, asker, now)\n"
+    "    candle(ARGV[1], ap, amount, now)\n"
+    "end\n"
+};
+
+/*
+ * Split an element "ID USER" of a queue.
+ *
+ * return: the length of ID; *user is set to USER
+ */
+static size_t split_entry(const char *entry, size_t len, const char **user)
+{
+    const char *space = memchr(entry, ' ', len);
+
+    if (space == NULL) {
+        *user = entry + len;
+        return len;
+    }
+    *user = space + 1;
+    return space - entry;
+}
+
+/*
+ * Write "WHICH PRICE AMOUNT" of order id to orders, as one value, since
+ * hiredis would split the spaces of the format into arguments.
+ */
+static void store_order_value(long long id, int which, long long price,
+                              long long amount)
+{
+    char order[64];
+
+    snprintf(order, sizeof(order), "%d %lld %lld", which, price, amount);
+    command("HSET %sorders %lld %s", key_prefix, id, order);
+}
+
+/*
+ * Write an order to the tail of its queue in Redis.
+ *
+ * which: 0 for a bid, 1 for an ask
+ */
+static void store_order(int which, long long id, const char *user,
+                        long long price, long long amount)
+{
+    const char *cmd = side_key[which];
+    char entry[ENTRY_MAX];
+
+    snprintf(entry, sizeof(entry), "%lld %s", id, user);
+    command("ZADD %s_prices %lld %lld", cmd, price, price);
+    command("RPUSH %s_queue@%lld %s", cmd, price, entry);
+    store_order_value(id, which, price, amount);
+    command("HINCRBY %s_level_amounts %lld %lld", cmd, price, amount);
+    command("HINCRBY %s_level_counts %lld 1", cmd, price);
+    publish_level(which, price);
+}
+
+/*
+ * Drop the head of the queue at price, which is done or cancelled.
+ */
+static void store_pop(int which, long long price)
+{
+    const char *cmd = side_key[which];
+
+    command("LPOP %s_queue@%lld", cmd, price);
+}
+
+/*
+ * Write the new amount of the head order id at price after traded was taken
+ * from it, removing the order if nothing is left.
+ */
+static void store_head(int which, long long price, long long id,
+                       long long amount, long long traded)
+{
+    const char *cmd = side_key[which];
+
+    if (amount == 0) {
+        store_pop(which, price);
+        command("HDEL %sorders %lld", key_prefix, id);
+        command("HINCRBY %s_level_counts %lld -1", cmd, price);
+    } else {
+        store_order_value(id, which, price, amount);
+    }
+    command("HINCRBY %s_level_amounts %lld %lld", cmd, price, -traded);
+    publish_level(which, price);
+}
+
+/*
+ * Remove a price without orders, along with the cancelled ones left in its
+ * queue. The level was published with count 0 when its last order went.
+ */
+static void store_remove_level(int which, long long price)
+{
+    const char *cmd = side_key[which];
+
+    command("ZREM %s_prices %lld", cmd, price);
+    command("HDEL %s_level_amounts %lld", cmd, price);
+    command("HDEL %s_level_counts %lld", cmd, price);
+    command("DEL %s_queue@%lld", cmd, price);
+}
+
+/*
+ * Change the amount of order id at price from old_amount to amount, or
+ * cancel it if amount is 0. store_remove_level() should follow if that
+ * leaves no order at price.
+ */
+static void store_amend(int which, long long price, long long id,
+                        long long old_amount, long long amount)
+{
+    const char *cmd = side_key[which];
+
+    if (amount > 0) {
+        store_order_value(id, which, price, amount);
+    } else {
+        command("HDEL %sorders %lld", key_prefix, id);
+        command("HINCRBY %s_level_counts %lld -1", cmd, price);
+    }
+    command("HINCRBY %s_level_amounts %lld %lld", cmd, price,
+            amount - old_amount);
+    publish_level(which, price);
+}
+
+/* the timestamp of the current match cycle in nanoseconds since the
+   epoch, and the number of its trades so far */
+static __thread long long match_time;
+static __thread int match_fills;
+
+/*
+ * Start a match cycle. Its trades share one timestamp, taken here once,
+ * and are told apart by their fill numbers. The timestamps of a thread
+ * increase even if the clock steps back.
+ */
+static void begin_match()
+{
+    struct timespec ts;
+    long long t;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    t = ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+    match_time = t > match_time ? t : match_time + 1;
+    match_fills = 0;
+}
+
+/* the most trades that store_trades() writes at once */
+#define TRADE_BATCH 64
+
+/* the records of the trades not written yet, in the arena */
+static __thread const char *trade_records[TRADE_BATCH];
+static __thread size_t trade_record_lens[TRADE_BATCH];
+static __thread int n_trade_records;
+
+/*
+ * Write the trades of store_trade() to matched_trades with one LPUSH,
+ * index them and add them to the candles with one EVALSHA, and publish
+ * them.
+ */
+static void store_trades()
+{
+    const char *argv[4 + TRADE_BATCH];
+    size_t argvlen[4 + TRADE_BATCH];
+    char key[MAX_SYMBOL + 20], msg[128];
+    struct trade trade;
+    int i, n = n_trade_records;
+
+    if (n == 0) return;
+    n_trade_records = 0;
+    snprintf(key, sizeof(key), "%smatched_trades", key_prefix);
+    argv[0] = "LPUSH";
+    argvlen[0] = 5;
+    argv[1] = key;
+    argvlen[1] = strlen(key);
+    memcpy(argv + 2, trade_records, n * sizeof(*argv));
+    memcpy(argvlen + 2, trade_record_lens, n * sizeof(*argvlen));
+    command_argv(2 + n, argv, argvlen);
+
+    argv[2] = "0";
+    argvlen[2] = 1;
+    argv[3] = key_prefix;
+    argvlen[3] = strlen(key_prefix);
+    memcpy(argv + 4, trade_records, n * sizeof(*argv));
+    memcpy(argvlen + 4, trade_record_lens, n * sizeof(*argvlen));
+    script_command_argv(&trade_script, 4 + n, argv, argvlen);
+
+    for (i = 0; publish && i < n; i++) {
+        unpack_trade(trade_records[i], trade_record_lens[i], &trade);
+        snprintf(msg, sizeof(msg), "T %lld %lld %lld %lld.%09lld",
+                 trade.bid_price, trade.ask_price, trade.amount,
+                 trade.timestamp / NS_PER_SEC, trade.timestamp % NS_PER_SEC);
+        publish_message(msg);
+    }
+}
+
+/*
+ * Add a trade of the current match cycle to matched_trades, its indexes,
+ * and its candles, once store_trades() is called or TRADE_BATCH trades
+ * are waiting.
+ */
+static void store_trade(const char *bidder, long long bid_price,
+                        const char *asker, long long ask_price,
+                        long long amount)
+{
+    struct trade trade = {
+        bid_price, ask_price, amount, match_time, match_fills++,
+        bidder, asker, strlen(bidder), strlen(asker)
+    };
+    char *record = arena_alloc(TRADE_RECORD_MAX);
+
+    if (n_trade_records == TRADE_BATCH) store_trades();
+    trade_record_lens[n_trade_records] = pack_trade(record, &trade);
+    trade_records[n_trade_records++] = record;
+}
+
+/*
+ * Unlink all the keys of a book in one round trip. UNLINK frees the values
+ * in the background, so even a book of long queues does not block Redis.
+ *
+ * ARGV[1]: key_prefix of the book
+ * return: the number of keys removed
+ */
+static __thread struct script clear_script = {
+    "local p, keys, n = ARGV[1], {}, 0\n"
+    "local function unlink()\n"
+    "    if #keys > 0 then n = n + redis.call('UNLINK', unpack(keys)) end\n"
+    "    keys = {}\n"
+    "end\n"
+    "for _, side in ipairs({'bid', 'ask'}) do\n"
+    "    for _, price in ipairs(redis.call('ZRANGE', p .. side .. '_prices',\n"
+    "                                      0, -1)) do\n"
+    "        keys[#keys + 1] = p .. side .. '_queue@' .. price\n"
+    "        -- unpack() takes a few thousand arguments at most\n"
+    "        if #keys == 1024 then unlink() end\n"
+    "    end\n"
+    "    keys[#keys + 1] = p .. side .. '_prices'\n"
+    "    keys[#keys + 1] = p .. side .. '_level_amounts'\n"
+    "    keys[#keys + 1] = p .. side .. '_level_counts'\n"
+    "end\n"
+    "keys[#keys + 1] = p .. 'orders'\n"
+    "keys[#keys + 1] = p .. 'matched_trades'\n"
+    "for _, user in ipairs(redis.call('SMEMBERS', p .. 'trade_users')) do\n"
+    "    keys[#keys + 1] = p .. 'user_trades@' .. user\n"
+    "    if #keys == 1024 then unlink() end\n"
+    "end\n"
+    "keys[#keys + 1] = p .. 'trade_users'\n"
+    "keys[#keys + 1] = p .. 'trade_ids'\n"
+    "keys[#keys + 1] = p .. 'trades'\n"
+    "keys[#keys + 1] = p .. 'trade_times'\n"
+    "for _, interval in ipairs({1, 60, 3600}) do\n"
+    "    keys[#keys + 1] = p .. 'candles@' .. interval\n"
+    "end\n"
+    "unlink()\n"
+    "return n\n"
+};
+
+/*
+ * Remove all data of the current book in Redis.
+ */
+static void clear()
+{
+    redisReply *reply = eval_script(&clear_script, "0 %s", key_prefix);
+
+    if (reply->type == REDIS_REPLY_ERROR) {
+        fprintf(stderr, "clear: %s\n", reply->str);
+    }
+    freeReplyObject(reply);
+    publish_message("C");
+}
+
+/*
+ * Write a row of depth().
+ */
+static void out_level_row(long long count, long long amount, long long total,
+                          long long price)
+{
+    out_begin_object(NULL);
+    out_count("count", count);
+    out_fixed("amount", amount);
+    out_fixed("total", total);
+    out_fixed("price", price);
+    out_end();
+}
+
+/*
+ * Queue two HMGETs for the total amounts and the order counts of the first
+ * n prices in a ZRANGE reply. Their replies are in the same order as prices.
+ *
+ * which: 0 for bids, 1 for asks
+ */
+static void append_level_sizes(int which, redisReply *prices, size_t n)
+{
+    const char *cmd = side_key[which];
+    struct arena_mark mark = arena_mark();
+    const char **argv = arena_alloc((n + 2) * sizeof(char *));
+    size_t *argvlen = arena_alloc((n + 2) * sizeof(size_t));
+    char amounts_key[64], counts_key[64];
+    size_t i;
+
+    snprintf(amounts_key, sizeof(amounts_key), "%s_level_amounts", cmd);
+    snprintf(counts_key, sizeof(counts_key), "%s_level_counts", cmd);
+    for (i = 0; i < n; i++) {
+        argv[i + 2] = prices->element[i]->str;
+        argvlen[i + 2] = prices->element[i]->len;
+    }
+    argv[0] = "HMGET";
+    argvlen[0] = 5;
+    argv[1] = amounts_key;
+    argvlen[1] = strlen(amounts_key);
+    append_command_argv(n + 2, argv, argvlen);
+    argv[1] = counts_key;
+    argvlen[1] = strlen(counts_key);
+    append_command_argv(n + 2, argv, argvlen);
+    arena_release(mark);
+}
+
+/*
+ * Write the rows of the first n prices of a side, skipping offset of them.
+ * amounts and counts are the HMGET replies of append_level_sizes().
+ */
+static void out_side(redisReply *prices, redisReply *amounts,
+                     redisReply *counts, int n, int offset)
+{
+    long long total;
+    int i;
+
+    for (total = 0, i = 0; i < n; i++) {
+        long long amount = get_reply_int(amounts->element[i]);
+        total += amount;
+        if (i < offset) continue;
+        out_level_row(get_reply_int(counts->element[i]), amount, total,
+                      get_reply_int(prices->element[i]));
+    }
+}
+
+static void depth_async(int offset, int limit);
+
+/*
+ * List the unmatched prices from the best one: the highest bid price and the
+ * lowest ask price. The total of a row includes the levels skipped by
+ * offset.
+ *
+ * offset: the number of best prices to skip on each side
+ * limit: the number of prices to list on each side, or -1 for all of them
+ *        (and no "next" cursor)
+ */
+static void depth(int offset, int limit)
+{
+    redisReply *prices, *amounts, *counts;
+    int n, more = 0;
+
+    int which;
+    const char *get_prices_cmd[2] = {"ZREVRANGE %s_prices 0 %d",
+                                     "ZRANGE %s_prices 0 %d"},
+               *json_col[2] = {"bids", "asks"};
+
+    if (async_request) {
+        depth_async(offset, limit);
+        return;
+    }
+
+    out_begin_object(NULL);
+    for (which = 0; which < 2; which++) {
+        out_begin_array(json_col[which]);
+        /* one more price to tell whether there is a next page */
+        prices = query(get_prices_cmd[which], side_key[which],
+                       limit < 0 ? -1 : offset + limit);
+        n = prices->elements;
+        if (limit >= 0 && n > offset + limit) {
+            n = offset + limit;
+            more = 1;
+        }
+        if (n > 0) {
+            append_level_sizes(which, prices, n);
+            amounts = get_reply();
+            counts = get_reply();
+            out_side(prices, amounts, counts, n, offset);
+            freeReplyObject(amounts);
+            freeReplyObject(counts);
+        }
+        out_end();
+        freeReplyObject(prices);
+    }
+    if (limit >= 0) {
+        if (more) out_int("next", offset + limit);
+        else out_null("next");
+    }
+    out_end();
+    out_finish();
+}
+
+/*
+ * List all unmatched prices.
+ */
+static void list()
+{
+    depth(0, -1);
+}
+
+/* the most head orders of a queue that a round of trade() reads */
+#define TRADE_FETCH 64
+
+/*
+ * The head orders of a queue read by a round of trade().
+ */
+struct queue_batch {
+    redisReply *entries;    /* the elements "ID USER" */
+    size_t n;               /* the number of entries */
+    size_t *id_lens;
+    const char **users;
+    long long *amounts;     /* -1 for a cancelled order */
+    long long *left;        /* what is left of amounts after trading */
+    size_t done;            /* the orders at the head done or cancelled */
+    int filled;             /* the done ones, which leave the level */
+    long long traded;       /* the amount taken from the level */
+};
+
+/*
+ * Write what a round of trade() did to the queue of which at price.
+ */
+static void store_queue_batch(int which, long long price,
+                              const struct queue_batch *q)
+{
+    const char *cmd = side_key[which];
+    const char **argv = arena_alloc((2 + q->n) * sizeof(*argv));
+    size_t *argvlen = arena_alloc((2 + q->n) * sizeof(*argvlen));
+    char key[MAX_SYMBOL + 12];
+    size_t i;
+    int argc = 2;
+
+    if (q->done > 0) {
+        command("LTRIM %s_queue@%lld %lld -1", cmd, price,
+                (long long)q->done);
+    }
+    if (q->filled > 0) {
+        snprintf(key, sizeof(key), "%sorders", key_prefix);
+        argv[0] = "HDEL";
+        argvlen[0] = 4;
+        argv[1] = key;
+        argvlen[1] = strlen(key);
+        for (i = 0; i < q->done; i++) {
+            if (q->amounts[i] < 0) continue;
+            argv[argc] = q->entries->element[i]->str;
+            argvlen[argc++] = q->id_lens[i];
+        }
+        command_argv(argc, argv, argvlen);
+        command("HINCRBY %s_level_counts %lld %d", cmd, price, -q->filled);
+    }
+    /* The order at the head now may be partly filled. */
+    if (q->done < q->n && q->left[q->done] != q->amounts[q->done]) {
+        store_order_value(strtoll(q->entries->element[q->done]->str, NULL,
+                                  10), which, price, q->left[q->done]);
+    }
+    if (q->traded > 0) {
+        command("HINCRBY %s_level_amounts %lld %lld", cmd, price, -q->traded);
+        publish_level(which, price);
+    }
+}
+
+/*
+ * Trade the orders at given prices based on FIFO. Each round reads up to
+ * TRADE_FETCH head orders of both queues with one LRANGE each and their
+ * amounts with one HMGET, matches them here, and writes the result with a
+ * few commands per queue, so that sweeping a level of many small orders
+ * takes a few round trips, not one per order.
+ *
+ * return: the number of trades
+ *         *bid_fully_matched == 1 if bid_price is fully matched.
+ *         *ask_fully_matched == 1 if ask_price is fully matched.
+ */
+static int trade(long long bid_price, long long ask_price,
+                 int *bid_fully_matched, int *ask_fully_matched)
+{
+    const long long price[2] = {bid_price, ask_price};
+    int *fully_matched[2] = {bid_fully_matched, ask_fully_matched};
+    struct queue_batch q[2];
+    redisReply *orders;
+    long long start = stat_begin(STAT_TRADE), amount;
+    int trades = 0, which, done = 0;
+
+    while (!done) {
+        struct arena_mark mark = arena_mark();
+        const char **argv;
+        size_t *argvlen, i, j, k;
+        char key[MAX_SYMBOL + 12];
+
+        /* Fetch the head orders of both queues in one round trip. In
+           pipelined mode, the writes of the previous round go out in the
+           same batch. */
+        for (which = 0; which < 2; which++) {
+            append_command("LRANGE %s_queue@%lld 0 %d", side_key[which],
+                           price[which], TRADE_FETCH - 1);
+        }
+        flush_commands();
+        for (which = 0; which < 2; which++) {
+            memset(&q[which], 0, sizeof(q[which]));
+            q[which].entries = get_reply();
+            if (q[which].entries->type == REDIS_REPLY_ARRAY) {
+                q[which].n = q[which].entries->elements;
+            }
+        }
+
+        /* Stop when either bid price or ask price run out of orders. */
+        if (q[0].n == 0 || q[1].n == 0) {
+            for (which = 0; which < 2; which++) {
+                *fully_matched[which] = q[which].n == 0;
+                if (q[which].n == 0) store_remove_level(which, price[which]);
+                freeReplyObject(q[which].entries);
+            }
+            arena_release(mark);
+            break;
+        }
+
+        /* and their amounts in another */
+        argv = arena_alloc((2 + q[0].n + q[1].n) * sizeof(*argv));
+        argvlen = arena_alloc((2 + q[0].n + q[1].n) * sizeof(*argvlen));
+        snprintf(key, sizeof(key), "%sorders", key_prefix);
+        argv[0] = "HMGET";
+        argvlen[0] = 5;
+        argv[1] = key;
+        argvlen[1] = strlen(key);
+        for (which = 0, k = 2; which < 2; which++) {
+            q[which].id_lens = arena_alloc(q[which].n * sizeof(size_t));
+            q[which].users = arena_alloc(q[which].n * sizeof(char *));
+            for (i = 0; i < q[which].n; i++, k++) {
+                redisReply *entry = q[which].entries->element[i];
+                q[which].id_lens[i] = split_entry(entry->str, entry->len,
+                                                  &q[which].users[i]);
+                argv[k] = entry->str;
+                argvlen[k] = q[which].id_lens[i];
+            }
+        }
+        append_command_argv(k, argv, argvlen);
+        flush_commands();
+        orders = get_reply();
+        if (orders->type != REDIS_REPLY_ARRAY || orders->elements != k - 2) {
+            fprintf(stderr, "HMGET orders: %s\n",
+                    orders->type == REDIS_REPLY_ERROR ? orders->str
+                                                      : "bad reply");
+            *bid_fully_matched = *ask_fully_matched = 1;
+            freeReplyObject(orders);
+            freeReplyObject(q[0].entries);
+            freeReplyObject(q[1].entries);
+            arena_release(mark);
+            break;
+        }
+        for (which = 0, k = 0; which < 2; which++) {
+            q[which].amounts = arena_alloc(q[which].n * sizeof(long long));
+            q[which].left = arena_alloc(q[which].n * sizeof(long long));
+            for (i = 0; i < q[which].n; i++, k++) {
+                q[which].amounts[i] = get_order_amount(orders->element[k]);
+                q[which].left[i] = q[which].amounts[i];
+            }
+        }
+        freeReplyObject(orders);
+
+        /* Match the orders read, dropping the cancelled ones, until either
+           queue runs out of them. */
+        for (i = j = 0; ; ) {
+            while (i < q[0].n && q[0].left[i] < 0) i++;
+            while (j < q[1].n && q[1].left[j] < 0) j++;
+            if (i == q[0].n || j == q[1].n) break;
+
+            amount = q[0].left[i] < q[1].left[j] ? q[0].left[i]
+                                                 : q[1].left[j];
+            q[0].left[i] -= amount;
+            q[1].left[j] -= amount;
+            q[0].traded += amount;
+            q[1].traded += amount;
+            store_trade(q[0].users[i], bid_price, q[1].users[j], ask_price,
+                        amount);
+            trades++;
+            if (q[0].left[i] == 0) {
+                q[0].filled++;
+                i++;
+            }
+            if (q[1].left[j] == 0) {
+                q[1].filled++;
+                j++;
+            }
+        }
+        q[0].done = i;
+        q[1].done = j;
+        store_trades();
+
+        for (which = 0; which < 2; which++) {
+            store_queue_batch(which, price[which], &q[which]);
+            /* A queue read to its end has no order left. */
+            *fully_matched[which] = q[which].done == q[which].n &&
+                                    q[which].n < TRADE_FETCH;
+            if (*fully_matched[which]) {
+                store_remove_level(which, price[which]);
+                done = 1;
+            }
+            freeReplyObject(q[which].entries);
+        }
+        arena_release(mark);
+    }
+
+    stat_end(STAT_TRADE, start);
+    return trades;
+}
+
+/*
+ * Parse the elements of an array reply of integers once.
+ *
+ * return: an array of reply->elements integers in the arena
+ */
+static long long *get_reply_ints(redisReply *reply)
+{
+    long long *v = arena_alloc(reply->elements * sizeof(long long));
+    size_t i;
+
+    for (i = 0; i < reply->elements; i++) {
+        v[i] = strtoll(reply->element[i]->str, NULL, 10);
+    }
+    return v;
+}
+
+/*
+ * v[0 .. n - 1]: ascending
+ * return: index of the first element not below value
+ */
+static int lower_bound(const long long *v, int n, long long value)
+{
+    int lo = 0, hi = n;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (v[mid] < value) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Eliminate the overlap between bid prices and ask prices.
+ * return: the number of trades
+ */
+static int match()
+{
+    /* bid prices and ask prices */
+    redisReply *reply;
+    long long *bid_prices, *ask_prices;
+    int bids, asks;
+
+    begin_match();
+    reply = query("ZRANGE %s_prices 0 -1", side_key[0]);
+    bids = reply->elements;
+    bid_prices = get_reply_ints(reply);
+    freeReplyObject(reply);
+    if (bids == 0) return 0;
+    reply = query("ZRANGE %s_prices 0 -1", side_key[1]);
+    asks = reply->elements;
+    ask_prices = get_reply_ints(reply);
+    freeReplyObject(reply);
+    if (asks == 0) return 0;
+
+    /* indices of the lowest bid price which is above or equal to the lowest
+       ask price, and the highest ask price which is below or equal to the
+       highest bid price, respectively */
+    int b_lb = lower_bound(bid_prices, bids, ask_prices[0]);
+    int a_ub = lower_bound(ask_prices, asks, bid_prices[bids - 1] + 1) - 1;
+
+    /* no overlap between bid prices and ask prices */
+    if (b_lb >= bids || a_ub < 0) return 0;
+
+    /* indices to iterate bid prices and ask prices */
+    int b = b_lb, a = 0;
+
+    int trades = 0;
+
+    while (1) {
+        int bid_fully_matched, ask_fully_matched;
+        trades += trade(bid_prices[b], ask_prices[a],
+                        &bid_fully_matched, &ask_fully_matched);
+        /* Move past a fully matched bid price before looking for the bid
+           price matching the next ask price. */
+        if (bid_fully_matched) {
+            b++;
+            if (b >= bids) break;
+        }
+        if (ask_fully_matched) {
+            a++;
+            if (a > a_ub) break;
+            b += lower_bound(bid_prices + b, bids - b, ask_prices[a]);
+        }
+    }
+
+    return trades;
+}
+
+/*
+ * The same algorithm as match() and trade(), run inside Redis so that a
+ * whole match cycle is one round trip and atomic. Instead of binary
+ * searching the whole ladders, it reads only the prices between the best
+ * ask price and the best bid price.
+ *
+ * KEYS[1], KEYS[2]: the bid and the ask price ZSETs of the book
+ * ARGV[1]: the seconds of the timestamp of the trades
+ * ARGV[2]: key_prefix of the book
+ * ARGV[3]: 1 to publish the changes to market, or 0
+ * ARGV[4]: the nanoseconds of the timestamp
+ * return: the number of trades
+ */
+static __thread struct script match_script = {
+    MARKET_LUA
+    TRADE_LUA
+    "local now, p, market = tonumber(ARGV[1]), ARGV[2], ARGV[3] == '1'\n"
+    "local nanos, fills = tonumber(ARGV[4]), 0\n"
+    "local orders = p .. 'orders'\n"
+    "local function remove_level(side, price)\n"
+    "    redis.call('ZREM', p .. side .. '_prices', price)\n"
+    "    redis.call('HDEL', p .. side .. '_level_amounts', price)\n"
+    "    redis.call('HDEL', p .. side .. '_level_counts', price)\n"
+    "    redis.call('DEL', p .. side .. '_queue@' .. price)\n"
+    "end\n"
+    "-- the ID, the user, and the amount of the head order, dropping the\n"
+    "-- cancelled ones\n"
+    "local function head(side, price)\n"
+    "    local queue = p .. side .. '_queue@' .. price\n"
+    "    while true do\n"
+    "        local entry = redis.call('LINDEX', queue, 0)\n"
+    "        if not entry then return nil end\n"
+    "        local id, user = string.match(entry, '^(%d+) (.*)$')\n"
+    "        local order = redis.call('HGET', orders, id)\n"
+    "        if order then\n"
+    "            return id, user, tonumber(string.match(order, '(%d+)$'))\n"
+    "        end\n"
+    "        redis.call('LPOP', queue)\n"
+    "    end\n"
+    "end\n"
+    "local function fill(side, price, id, left, amount)\n"
+    "    if left == 0 then\n"
+    "        redis.call('LPOP', p .. side .. '_queue@' .. price)\n"
+    "        redis.call('HDEL', orders, id)\n"
+    "        redis.call('HINCRBY', p .. side .. '_level_counts', price, -1)\n"
+    "    else\n"
+    "        redis.call('HSET', orders, id, string.format('%d %s %d',\n"
+    "                   side == 'bid' and 0 or 1, price, left))\n"
+    "    end\n"
+    "    redis.call('HINCRBY', p .. side .. '_level_amounts', price,\n"
+    "               string.format('%d', -amount))\n"
+    "    if market then publish_level(p, side, price) end\n"
+    "end\n"
+    "local function trade(bp, ap)\n"
+    "    local trades = 0\n"
+    "    while true do\n"
+    "        local bid, bidder, b = head('bid', bp)\n"
+    "        local ask, asker, a = head('ask', ap)\n"
+    "        if not bid then remove_level('bid', bp) end\n"
+    "        if not ask then remove_level('ask', ap) end\n"
+    "        if not bid or not ask then return trades, not bid, not ask end\n"
+    "        local amount = math.min(b, a)\n"
+    "        local record = struct.pack('<Bi8i8i8i8I4I4Bc0Bc0', 2,\n"
+    "                                   tonumber(bp), tonumber(ap), amount,\n"
+    "                                   now, nanos, fills,\n"
+    "                                   #bidder, bidder, #asker, asker)\n"
+    "        fills = fills + 1\n"
+    "        redis.call('LPUSH', p .. 'matched_trades', record)\n"
+    "        index_trade(p, record, bidder, asker, now)\n"
+    "        candle(p, tonumber(ap), amount, now)\n"
+    "        if market then\n"
+    "            publish(p, string.format('T %s %s %d %d.%09d', bp, ap,\n"
+    "                                     amount, now, nanos))\n"
+    "        end\n"
+    "        trades = trades + 1\n"
+    "        fill('bid', bp, bid, b - amount, amount)\n"
+    "        fill('ask', ap, ask, a - amount, amount)\n"
+    "    end\n"
+    "end\n"
+    "local best_bid = redis.call('ZREVRANGE', KEYS[1], 0, 0)[1]\n"
+    "local best_ask = redis.call('ZRANGE', KEYS[2], 0, 0)[1]\n"
+    "if not best_bid or not best_ask or\n"
+    "   tonumber(best_bid) < tonumber(best_ask) then\n"
+    "    return 0\n"
+    "end\n"
+    "-- Only the overlapping prices are read, so a match after each order\n"
+    "-- touches just the levels that order crosses.\n"
+    "local bids = redis.call('ZRANGEBYSCORE', KEYS[1], best_ask, '+inf')\n"
+    "local asks = redis.call('ZRANGEBYSCORE', KEYS[2], '-inf', best_bid)\n"
+    "local b, a_ub = 1, #asks\n"
+    "local a, trades = 1, 0\n"
+    "while true do\n"
+    "    local n, bid_done, ask_done = trade(bids[b], asks[a])\n"
+    "    trades = trades + n\n"
+    "    if bid_done then\n"
+    "        b = b + 1\n"
+    "        if b > #bids then break end\n"
+    "    end\n"
+    "    if ask_done then\n"
+    "        a = a + 1\n"
+    "        if a > a_ub then break end\n"
+    "        while tonumber(bids[b]) < tonumber(asks[a]) do b = b + 1 end\n"
+    "    end\n"
+    "end\n"
+    "return trades\n"
+};
+
+static int match_lua()
+{
+    redisReply *reply;
+    int trades = 0;
+
+    begin_match();
+    reply = eval_script(&match_script, "2 %s_prices %s_prices %lld %s %d %lld",
+                        side_key[0], side_key[1], match_time / NS_PER_SEC,
+                        key_prefix, publish, match_time % NS_PER_SEC);
+
+    if (reply->type == REDIS_REPLY_INTEGER) {
+        trades = reply->integer;
+    } else if (reply->type == REDIS_REPLY_ERROR) {
+        fprintf(stderr, "match: %s\n", reply->str);
+    }
+    freeReplyObject(reply);
+    return trades;
+}
+
+/*
+ * Match a new order at price against the other side, from its best price
+ * down to price, and leave the rest of the order in the book.
+ *
+ * which: 0 for a bid, 1 for an ask
+ * return: the number of trades
+ */
+static int match_order(int which, long long price)
+{
+    const int page = 16;
+    redisReply *prices;
+    int i, offset, trades = 0, done = 0;
+
+    begin_match();
+    for (offset = 0; !done; offset += page) {
+        if (which == 0) {
+            prices = query("ZRANGEBYSCORE %s_prices -inf %lld LIMIT %d %d",
+                           side_key[1], price, offset, page);
+        } else {
+            prices = query("ZREVRANGEBYSCORE %s_prices +inf %lld LIMIT %d %d",
+                           side_key[0], price, offset, page);
+        }
+        done = prices->elements < page;
+        for (i = 0; i < prices->elements; i++) {
+            long long other = get_reply_int(prices->element[i]);
+            int bid_fully_matched, ask_fully_matched;
+            trades += which == 0 ?
+                trade(price, other, &bid_fully_matched, &ask_fully_matched) :
+                trade(other, price, &bid_fully_matched, &ask_fully_matched);
+            if (which == 0 ? bid_fully_matched : ask_fully_matched) {
+                done = 1;
+                break;
+            }
+            /* The fully matched level left the ZSET. */
+            offset--;
+        }
+        freeReplyObject(prices);
+    }
+    return trades;
+}
+
+/*
+ * Add an order.
+ *
+ * which: 0 for a bid, 1 for an ask
+ * return: the ID of the order, or 0 on error
+ */
+static long long bid_ask(int which, const char *user,
+                         long long price, long long amount)
+{
+    long long id = new_order_id();
+
+    if (id == 0) return 0;
+    store_order(which, id, user, price, amount);
+    if (auto_match) {
+        if (lua_match) match_lua();
+        else match_order(which, price);
+    }
+    return id;
+}
+
+/*
+ * Change the amount of an order in the book without moving it, or cancel
+ * it, removing its price if no order is left there.
+ *
+ * KEYS[1]: orders
+ * ARGV[1]: the ID of the order
+ * ARGV[2]: the new amount, at most the amount left, or 0 to cancel
+ * ARGV[3]: key_prefix of the book
+ * ARGV[4]: 1 to publish the change to market, or 0
+ * return: 1 if done, 0 if there is no such order, or -1 if ARGV[2] is too
+ *         large
+ */
+static __thread struct script amend_script = {
+    MARKET_LUA
+    "local order = redis.call('HGET', KEYS[1], ARGV[1])\n"
+    "if not order then return 0 end\n"
+    "local which, price, amount = string.match(order, '(%d) (%d+) (%d+)')\n"
+    "local new = tonumber(ARGV[2])\n"
+    "amount = tonumber(amount)\n"
+    "if new > amount then return -1 end\n"
+    "local name = which == '0' and 'bid' or 'ask'\n"
+    "local side = ARGV[3] .. name\n"
+    "if new > 0 then\n"
+    "    redis.call('HSET', KEYS[1], ARGV[1],\n"
+    "               which .. ' ' .. price .. ' ' .. ARGV[2])\n"
+    "else\n"
+    "    redis.call('HDEL', KEYS[1], ARGV[1])\n"
+    "    if redis.call('HINCRBY', side .. '_level_counts', price, -1) == 0\n"
+    "    then\n"
+    "        redis.call('ZREM', side .. '_prices', price)\n"
+    "        redis.call('HDEL', side .. '_level_amounts', price)\n"
+    "        redis.call('HDEL', side .. '_level_counts', price)\n"
+    "        redis.call('DEL', side .. '_queue@' .. price)\n"
+    "        if ARGV[4] == '1' then publish_level(ARGV[3], name, price) end\n"
+    "        return 1\n"
+    "    end\n"
+    "end\n"
+    "redis.call('HINCRBY', side .. '_level_amounts', price,\n"
+    "           string.format('%d', new - amount))\n"
+    "if ARGV[4] == '1' then publish_level(ARGV[3], name, price) end\n"
+    "return 1\n"
+};
+
+/*
+ * Set the amount of order id to amount, or cancel it if amount is 0.
+ *
+ * return: the same as amend_script
+ */
+static int amend(long long id, long long amount)
+{
+    redisReply *reply = eval_script(&amend_script,
+                                    "1 %sorders %lld %lld %s %d", key_prefix,
+                                    id, amount, key_prefix, publish);
+    int done = 0;
+
+    if (reply->type == REDIS_REPLY_INTEGER) {
+        done = reply->integer;
+    } else if (reply->type == REDIS_REPLY_ERROR) {
+        fprintf(stderr, "amend: %s\n", reply->str);
+    }
+    freeReplyObject(reply);
+    return done;
+}
+
+/*
+ * In-memory Book (--memory)
+ *
+ * The book is loaded from Redis at startup and then owned by this process:
+ * bid, ask, list, and match never wait for Redis. Every change is also
+ * queued as the same Redis writes the other modes make, which are sent in
+ * pipelined batches behind the engine. This assumes no other process
+ * changes the book meanwhile.
+ */
+
+struct order {
+    struct order *next;     /* FIFO link */
+    long long id;
+    long long price;
+    long long amount;
+    unsigned char which;    /* 0: bid, 1: ask */
+    unsigned char cancelled;    /* left in the queue like in Redis */
+    char user[];
+};
+
+struct level {
+    long long price;
+    size_t count;           /* number of orders, not counting the cancelled */
+    long long amount;       /* sum of their amounts */
+    struct order *head, *tail;
+};
+
+/*
+ * levels[0 .. n - 1] in ascending order of price
+ */
+struct side {
+    struct level *levels;
+    int n, size;
+};
+
+/*
+ * The orders in a book by ID: an open-addressing hash table with linear
+ * probing, at most half full.
+ */
+struct order_index {
+    struct order **slots;
+    size_t size, n;         /* size is 0 or a power of 2 */
+};
+
+struct symbol_book {
+    char symbol[MAX_SYMBOL + 1];
+    struct side sides[2];
+    struct order_index index;
+};
+
+/* the books loaded so far, one per symbol */
+static __thread struct symbol_book **books;
+static __thread int n_books;
+
+/* book[0]: bids, book[1]: asks of the current symbol */
+static __thread struct side *book;
+
+/* the orders of the current symbol */
+static __thread struct order_index *orders_index;
+
+static inline size_t index_slot(const struct order_index *index,
+                                long long id)
+{
+    /* Fibonacci hashing spreads the consecutive IDs */
+    return (size_t)((unsigned long long)id * 11400714819323198485ULL >> 32) &
+           (index->size - 1);
+}
+
+static struct order *find_order(const struct order_index *index,
+                                long long id)
+{
+    size_t i;
+
+    if (index->size == 0) return NULL;
+    for (i = index_slot(index, id); index->slots[i];
+         i = (i + 1) & (index->size - 1)) {
+        if (index->slots[i]->id == id) return index->slots[i];
+    }
+    return NULL;
+}
+
+static void index_order(struct order_index *index, struct order *order)
+{
+    size_t i;
+
+    if (2 * (index->n + 1) > index->size) {
+        struct order **slots = index->slots;
+        size_t size = index->size;
+
+        index->size = size ? size * 2 : 1024;
+        index->slots = calloc(index->size, sizeof(struct order *));
+        index->n = 0;
+        for (i = 0; i < size; i++) {
+            if (slots[i]) index_order(index, slots[i]);
+        }
+        free(slots);
+    }
+    for (i = index_slot(index, order->id); index->slots[i];
+         i = (i + 1) & (index->size - 1));
+    index->slots[i] = order;
+    index->n++;
+}
+
+static void unindex_order(struct order_index *index, long long id)
+{
+    size_t mask = index->size - 1, i, j, k;
+
+    if (index->size == 0) return;
+    for (i = index_slot(index, id); index->slots[i]; i = (i + 1) & mask) {
+        if (index->slots[i]->id == id) break;
+    }
+    if (index->slots[i] == NULL) return;
+    /* Shift back the orders after i that could not take slot i. */
+    for (j = (i + 1) & mask; index->slots[j]; j = (j + 1) & mask) {
+        k = index_slot(index, index->slots[j]->id);
+        if (((j - k) & mask) >= ((j - i) & mask)) {
+            index->slots[i] = index->slots[j];
+            i = j;
+        }
+    }
+    index->slots[i] = NULL;
+    index->n--;
+}
+
+/*
+ * return: index of the first level whose price is not below price
+ */
+static int find_level(const struct side *side, long long price)
+{
+    int lo = 0, hi = side->n;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (side->levels[mid].price < price) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static struct level *get_level(struct side *side, long long price)
+{
+    int i = find_level(side, price);
+
+    if (i < side->n && side->levels[i].price == price) {
+        return &side->levels[i];
+    }
+
+    if (side->n == side->size) {
+        side->size = side->size ? side->size * 2 : 64;
+        side->levels = realloc(side->levels,
+                               side->size * sizeof(struct level));
+    }
+    memmove(&side->levels[i + 1], &side->levels[i],
+            (side->n - i) * sizeof(struct level));
+    side->n++;
+    memset(&side->levels[i], 0, sizeof(struct level));
+    side->levels[i].price = price;
+    return &side->levels[i];
+}
+
+static struct order *push_order(struct level *level, int which, long long id,
+                                const char *user, long long amount)
+{
+    struct order *order = malloc(sizeof(struct order) + strlen(user) + 1);
+
+    order->next = NULL;
+    order->id = id;
+    order->price = level->price;
+    order->amount = amount;
+    order->which = which;
+    order->cancelled = 0;
+    strcpy(order->user, user);
+    if (level->tail) level->tail->next = order;
+    else level->head = order;
+    level->tail = order;
+    level->count++;
+    level->amount += amount;
+    index_order(orders_index, order);
+    return order;
+}
+
+/*
+ * Take order out of the count and the amount of level, leaving it in the
+ * queue.
+ */
+static void cancel_order(struct level *level, struct order *order)
+{
+    unindex_order(orders_index, order->id);
+    level->count--;
+    level->amount -= order->amount;
+    order->amount = 0;
+    order->cancelled = 1;
+}
+
+static void pop_order(struct level *level)
+{
+    struct order *order = level->head;
+
+    if (!order->cancelled) cancel_order(level, order);
+    level->head = order->next;
+    if (level->head == NULL) level->tail = NULL;
+    free(order);
+}
+
+/*
+ * Drop the levels without orders.
+ */
+static void compact_side(struct side *side)
+{
+    int i, n;
+
+    for (n = i = 0; i < side->n; i++) {
+        if (side->levels[i].head) side->levels[n++] = side->levels[i];
+    }
+    side->n = n;
+}
+
+static void engine_clear()
+{
+    int which, i;
+
+    for (which = 0; which < 2; which++) {
+        for (i = 0; i < book[which].n; i++) {
+            while (book[which].levels[i].head) {
+                pop_order(&book[which].levels[i]);
+            }
+        }
+        book[which].n = 0;
+    }
+}
+
+/*
+ * Load the book from Redis.
+ */
+static void engine_load()
+{
+    redisReply *prices, **queues, *orders;
+    const char **argv = NULL;
+    size_t *argvlen = NULL, n, max = 0;
+    char key[64];
+    int which, i, j;
+
+    snprintf(key, sizeof(key), "%sorders", key_prefix);
+    for (which = 0; which < 2; which++) {
+        prices = query("ZRANGE %s_prices 0 -1", side_key[which]);
+        n = prices->elements;
+        for (i = 0; i < n; i++) {
+            const char *price = prices->element[i]->str;
+            append_command("LRANGE %s_queue@%s 0 -1", side_key[which], price);
+        }
+        queues = malloc(n * sizeof(redisReply *));
+        for (i = 0; i < n; i++) queues[i] = get_reply();
+
+        /* the amounts of the orders at each price, in one more round trip */
+        for (i = 0; i < n; i++) {
+            if (queues[i]->elements == 0) continue;
+            if (queues[i]->elements + 2 > max) {
+                max = queues[i]->elements + 2;
+                argv = realloc(argv, max * sizeof(char *));
+                argvlen = realloc(argvlen, max * sizeof(size_t));
+            }
+            argv[0] = "HMGET";
+            argvlen[0] = 5;
+            argv[1] = key;
+            argvlen[1] = strlen(key);
+            for (j = 0; j < queues[i]->elements; j++) {
+                const char *user;
+                argv[j + 2] = queues[i]->element[j]->str;
+                argvlen[j + 2] = split_entry(queues[i]->element[j]->str,
+                                             queues[i]->element[j]->len,
+                                             &user);
+            }
+            append_command_argv(queues[i]->elements + 2, argv, argvlen);
+        }
+        for (i = 0; i < n; i++) {
+            struct level *level = get_level(&book[which],
+                get_reply_int(prices->element[i]));
+            if (queues[i]->elements > 0) {
+                orders = get_reply();
+                for (j = 0; j < queues[i]->elements &&
+                     j < orders->elements; j++) {
+                    redisReply *entry = queues[i]->element[j];
+                    long long amount = get_order_amount(orders->element[j]);
+                    const char *user;
+                    struct order *order;
+
+                    split_entry(entry->str, entry->len, &user);
+                    order = push_order(level, which,
+                                       strtoll(entry->str, NULL, 10), user,
+                                       amount < 0 ? 0 : amount);
+                    if (amount < 0) cancel_order(level, order);
+                }
+                freeReplyObject(orders);
+            }
+            freeReplyObject(queues[i]);
+        }
+        free(queues);
+        compact_side(&book[which]);
+        freeReplyObject(prices);
+    }
+    free(argv);
+    free(argvlen);
+}
+
+/*
+ * Same as depth() on the in-memory book.
+ */
+static void engine_depth(int offset, int limit)
+{
+    const char *json_col[2] = {"bids", "asks"};
+    int which, i, n, more = 0;
+    long long total;
+
+    out_begin_object(NULL);
+    for (which = 0; which < 2; which++) {
+        const struct side *side = &book[which];
+        out_begin_array(json_col[which]);
+        n = side->n;
+        if (limit >= 0 && n > offset + limit) {
+            n = offset + limit;
+            more = 1;
+        }
+        /* best price first: the highest bid and the lowest ask */
+        for (total = 0, i = 0; i < n; i++) {
+            const struct level *level =
+                &side->levels[which == 0 ? side->n - 1 - i : i];
+            total += level->amount;
+            if (i < offset) continue;
+            out_level_row(level->count, level->amount, total, level->price);
+        }
+        out_end();
+    }
+    if (limit >= 0) {
+        if (more) out_int("next", offset + limit);
+        else out_null("next");
+    }
+    out_end();
+    out_finish();
+}
+
+/*
+ * Same as trade() on two in-memory levels.
+ */
+static int engine_trade(struct level *bid, struct level *ask,
+                        int *bid_fully_matched, int *ask_fully_matched)
+{
+    long long start = stat_begin(STAT_TRADE);
+    int trades = 0;
+
+    while (1) {
+        struct order *b, *a;
+        long long trade_amount;
+
+        /* Drop the cancelled orders as Redis does. */
+        while (bid->head && bid->head->cancelled) {
+            pop_order(bid);
+            store_pop(0, bid->price);
+        }
+        while (ask->head && ask->head->cancelled) {
+            pop_order(ask);
+            store_pop(1, ask->price);
+        }
+        if (bid->head == NULL || ask->head == NULL) break;
+
+        b = bid->head;
+        a = ask->head;
+        trade_amount = b->amount < a->amount ? b->amount : a->amount;
+        b->amount -= trade_amount;
+        a->amount -= trade_amount;
+        bid->amount -= trade_amount;
+        ask->amount -= trade_amount;
+        store_trade(b->user, bid->price, a->user, ask->price, trade_amount);
+        store_head(0, bid->price, b->id, b->amount, trade_amount);
+        store_head(1, ask->price, a->id, a->amount, trade_amount);
+        if (b->amount == 0) pop_order(bid);
+        if (a->amount == 0) pop_order(ask);
+        trades++;
+    }
+    store_trades();
+
+    *bid_fully_matched = bid->head == NULL;
+    *ask_fully_matched = ask->head == NULL;
+    if (*bid_fully_matched) store_remove_level(0, bid->price);
+    if (*ask_fully_matched) store_remove_level(1, ask->price);
+    stat_end(STAT_TRADE, start);
+    return trades;
+}
+
+/*
+ * Same as match() on the in-memory book.
+ */
+static int engine_match()
+{
+    struct side *bids = &book[0], *asks = &book[1];
+    int b, a, a_ub, trades = 0;
+
+    if (bids->n == 0 || asks->n == 0) return 0;
+    begin_match();
+
+    b = find_level(bids, asks->levels[0].price);
+    a_ub = find_level(asks, bids->levels[bids->n - 1].price + 1) - 1;
+    if (b >= bids->n || a_ub < 0) return 0;
+
+    a = 0;
+    while (1) {
+        int bid_fully_matched, ask_fully_matched;
+        trades += engine_trade(&bids->levels[b], &asks->levels[a],
+                               &bid_fully_matched, &ask_fully_matched);
+        if (bid_fully_matched) {
+            b++;
+            if (b >= bids->n) break;
+        }
+        if (ask_fully_matched) {
+            a++;
+            if (a > a_ub) break;
+            while (bids->levels[b].price < asks->levels[a].price) b++;
+        }
+    }
+
+    compact_side(bids);
+    compact_side(asks);
+    return trades;
+}
+
+/*
+ * Write the trades of an LRANGE reply of matched_trades.
+ */
+static void out_history(redisReply *reply)
+{
+    struct trade trade;
+    size_t i;
+
+    out_begin_array(NULL);
+    for (i = 0; i < reply->elements; i++) {
+        if (unpack_trade(reply->element[i]->str, reply->element[i]->len,
+                         &trade)) {
+            continue;
+        }
+        out_begin_object(NULL);
+        out_string("bidder", trade.bidder, trade.bidder_len);
+        out_fixed("bidprice", trade.bid_price);
+        out_string("asker", trade.asker, trade.asker_len);
+        out_fixed("askprice", trade.ask_price);
+        out_fixed("amount", trade.amount);
+        out_count("timestamp", trade.timestamp / NS_PER_SEC);
+        out_count("timestamp_ns", trade.timestamp);
+        out_count("fill", trade.fill);
+        out_end();
+    }
+    out_end();
+    out_finish();
+}
+
+static void history_async(int start, int stop);
+
+void history(int start, int stop)
+{
+    redisReply *reply;
+
+    if (async_request) {
+        history_async(start, stop);
+        return;
+    }
+    reply = query("LRANGE %smatched_trades %d %d", key_prefix, start, stop);
+    out_history(reply);
+    freeReplyObject(reply);
+}
+
+/*
+ * Read the records of the trades in an index, latest first.
+ *
+ * ARGV[1]: key_prefix of the book
+ * ARGV[2]: the index, trade_times or user_trades@USER
+ * ARGV[3], ARGV[4]: the latest and the earliest timestamps
+ * ARGV[5], ARGV[6]: the number of trades to skip and to read, -1 for all
+ * return: the records, nil for those gone
+ */
+static __thread struct script find_trades_script = {
+    "local p = ARGV[1]\n"
+    "local ids = redis.call('ZREVRANGEBYSCORE', p .. ARGV[2], ARGV[3],\n"
+    "                       ARGV[4], 'LIMIT', ARGV[5], ARGV[6])\n"
+    "local result = {}\n"
+    "-- unpack() is limited by the Lua stack\n"
+    "for i = 1, #ids, 1000 do\n"
+    "    local records = redis.call('HMGET', p .. 'trades',\n"
+    "                               unpack(ids, i, math.min(i + 999, #ids)))\n"
+    "    for k = 1, #records do result[#result + 1] = records[k] end\n"
+    "end\n"
+    "return result\n"
+};
+
+/*
+ * The same as history() for the trades from since to until, of user only
+ * unless it is NULL, from the indexes instead of matched_trades.
+ *
+ * since, until: timestamps, or "-inf" and "+inf"
+ * start, stop: as in LRANGE, so nothing if stop < start; Redis would take
+ *              a negative LIMIT count for all
+ */
+static void find_trades(const char *user, const char *since,
+                        const char *until, int start, int stop)
+{
+    redisReply *reply = eval_script(&find_trades_script,
+                                    "0 %s %s%s %s %s %d %d", key_prefix,
+                                    user ? "user_trades@" : "trade_times",
+                                    user ? user : "", until, since, start,
+                                    stop < 0 ? -1 :
+                                    stop < start ? 0 : stop - start + 1);
+
+    if (reply->type == REDIS_REPLY_ARRAY) {
+        out_history(reply);
+    } else {
+        fprintf(output, "error: %s\n", reply->type == REDIS_REPLY_ERROR ?
+                reply->str : "bad reply");
+    }
+    freeReplyObject(reply);
+}
+
+/*
+ * List the candles of interval seconds that start from from to to.
+ */
+static void candles(int interval, long long from, long long to)
+{
+    redisReply *reply = query("ZRANGEBYSCORE %scandles@%d %lld %lld",
+                              key_prefix, interval, from, to);
+    long long c[7];
+    size_t i, n = reply->type == REDIS_REPLY_ARRAY ? reply->elements : 0;
+
+    out_begin_array(NULL);
+    for (i = 0; i < n; i++) {
+        /* START OPEN HIGH LOW CLOSE VOLUME TRADES */
+        if (sscanf(reply->element[i]->str, "%lld %lld %lld %lld %lld %lld "
+                   "%lld", &c[0], &c[1], &c[2], &c[3], &c[4], &c[5],
+                   &c[6]) != 7) {
+            continue;
+        }
+        out_begin_object(NULL);
+        out_count("timestamp", c[0]);
+        out_fixed("open", c[1]);
+        out_fixed("high", c[2]);
+        out_fixed("low", c[3]);
+        out_fixed("close", c[4]);
+        out_fixed("volume", c[5]);
+        out_count("trades", c[6]);
+        out_end();
+    }
+    out_end();
+    out_finish();
+    freeReplyObject(reply);
+}
+
+/*
+ * Same as match_order() on the in-memory book.
+ */
+static int engine_match_order(int which, long long price)
+{
+    struct side *bids = &book[0], *asks = &book[1];
+    struct level *level;
+    int b, a, trades = 0, bid_fully_matched, ask_fully_matched;
+
+    begin_match();
+    if (which == 0) {
+        b = find_level(bids, price);
+        level = &bids->levels[b];
+        for (a = 0; a < asks->n && asks->levels[a].price <= price; a++) {
+            trades += engine_trade(level, &asks->levels[a],
+                                   &bid_fully_matched, &ask_fully_matched);
+            if (bid_fully_matched) break;
+        }
+    } else {
+        a = find_level(asks, price);
+        level = &asks->levels[a];
+        for (b = bids->n - 1; b >= 0 && bids->levels[b].price >= price; b--) {
+            trades += engine_trade(&bids->levels[b], level,
+                                   &bid_fully_matched, &ask_fully_matched);
+            if (ask_fully_matched) break;
+        }
+    }
+
+    compact_side(bids);
+    compact_side(asks);
+    return trades;
+}
+
+static long long engine_bid_ask(int which, const char *user,
+                                long long price, long long amount)
+{
+    long long id = new_order_id();
+
+    if (id == 0) return 0;
+    push_order(get_level(&book[which], price), which, id, user, amount);
+    store_order(which, id, user, price, amount);
+    if (auto_match) engine_match_order(which, price);
+    return id;
+}
+
+/*
+ * Same as amend() on the in-memory book.
+ */
+static int engine_amend(long long id, long long amount)
+{
+    struct order *order = find_order(orders_index, id);
+    struct side *side;
+    struct level *level;
+    int which;
+
+    if (order == NULL) return 0;
+    if (amount > order->amount) return -1;
+    which = order->which;
+    side = &book[which];
+    level = &side->levels[find_level(side, order->price)];
+    store_amend(which, order->price, id, order->amount, amount);
+    if (amount > 0) {
+        level->amount -= order->amount - amount;
+        order->amount = amount;
+        return 1;
+    }
+
+    cancel_order(level, order);
+    if (level->count == 0) {
+        while (level->head) pop_order(level);
+        store_remove_level(which, level->price);
+        compact_side(side);
+    }
+    return 1;
+}
+
+/*
+ * Point book to the in-memory book of the current symbol, loading it from
+ * Redis the first time.
+ */
+static void engine_select()
+{
+    int i;
+
+    for (i = 0; i < n_books; i++) {
+        if (strcmp(books[i]->symbol, symbol) == 0) {
+            book = books[i]->sides;
+            orders_index = &books[i]->index;
+            return;
+        }
+    }
+    books = realloc(books, (n_books + 1) * sizeof(*books));
+    books[n_books] = calloc(1, sizeof(struct symbol_book));
+    strcpy(books[n_books]->symbol, symbol);
+    book = books[n_books]->sides;
+    orders_index = &books[n_books++]->index;
+    engine_load();
+}
+
+/*
+ * A symbol starts with a letter and has only letters, digits, '.', '_',
+ * and '-', so it can neither be taken for a number nor break a hash tag.
+ */
+static int is_symbol(const char *name, size_t len)
+{
+    size_t i;
+
+    if (len == 0 || len > MAX_SYMBOL || !isalpha((unsigned char)name[0])) {
+        return 0;
+    }
+    for (i = 1; i < len; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '.' &&
+            name[i] != '_' && name[i] != '-') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Make name[0 .. len - 1] the current symbol, or the default book if len
+ * is 0.
+ *
+ * return: 0 on success, -1 if name is not a symbol
+ */
+static int select_symbol(const char *name, size_t len)
+{
+    int which;
+
+    if (len == strlen(symbol) && memcmp(name, symbol, len) == 0 &&
+        (book || !in_memory)) {
+        return 0;
+    }
+    if (len > 0 && !is_symbol(name, len)) return -1;
+
+    memcpy(symbol, name, len);
+    symbol[len] = '\0';
+    if (len > 0) snprintf(key_prefix, sizeof(key_prefix), "{%s}:", symbol);
+    else key_prefix[0] = '\0';
+    for (which = 0; which < 2; which++) {
+        snprintf(side_key[which], sizeof(side_key[which]), "%s%s",
+                 key_prefix, side_name[which]);
+    }
+    if (in_memory) engine_select();
+    return 0;
+}
+
+/*
+ * Batch Loading (load FILE, --batch)
+ *
+ * Orders are parsed in place from the whole input and written in chunks of
+ * BATCH_MAX. Within a chunk, the orders at the same price are appended by a
+ * single RPUSH and counted by a single HINCRBY per hash, and each
+ * side gets a single ZADD, all pipelined.
+ */
+
+#define BATCH_MAX 4096
+
+/* maximum number of arguments of a command read from a line */
+#define MAX_ARGS 12
+
+struct batch_order {
+    int which;              /* 0: bid, 1: ask */
+    int seq;                /* position in the input */
+    long long id, price, amount;
+    const char *user;
+    size_t user_len;
+};
+
+static void process_command(int argc, char **argv);
+static void dispatch(const char *line, size_t len);
+
+/*
+ * Split line into whitespace-separated arguments in place.
+ *
+ * return: the number of arguments, at most max
+ */
+static int split_args(char *line, char **argv, int max)
+{
+    int argc = 0;
+
+    while (argc < max) {
+        while (*line == ' ' || *line == '\t' || *line == '\r' ||
+               *line == '\n') line++;
+        if (*line == '\0') break;
+        argv[argc++] = line;
+        while (*line && *line != ' ' && *line != '\t' && *line != '\r' &&
+               *line != '\n') line++;
+        if (*line) *line++ = '\0';
+    }
+    return argc;
+}
+
+/*
+ * Split str[0 .. len - 1] into at most max whitespace-separated tokens
+ * without copying.
+ *
+ * return: the number of tokens
+ */
+static int split_tokens(const char *str, size_t len,
+                        const char **tok, size_t *tok_len, int max)
+{
+    const char *end = str + len;
+    int n = 0;
+
+    while (n < max) {
+        while (str < end && (*str == ' ' || *str == '\t' || *str == '\r')) {
+            str++;
+        }
+        if (str == end) break;
+        tok[n] = str;
+        while (str < end && *str != ' ' && *str != '\t' && *str != '\r') {
+            str++;
+        }
+        tok_len[n] = str - tok[n];
+        n++;
+    }
+    return n;
+}
+
+static int compare_batch_orders(const void *x, const void *y)
+{
+    const struct batch_order *a = x, *b = y;
+
+    if (a->which != b->which) return a->which - b->which;
+    if (a->price != b->price) return a->price < b->price ? -1 : 1;
+    return a->seq - b->seq;
+}
+
+/*
+ * Write orders[0 .. n - 1] to Redis (and the in-memory book), keeping the
+ * input order within each price.
+ */
+static void write_batch(struct batch_order *orders, int n)
+{
+    struct arena_mark mark = arena_mark();
+    const char **argv;
+    size_t *argvlen, size = 0;
+    char (*num)[48], key[64], *entry;
+    int i, j, k, argc;
+    long long amount;
+
+    if (n == 0) return;
+    argv = arena_alloc((2 * n + 2) * sizeof(char *));
+    argvlen = arena_alloc((2 * n + 2) * sizeof(size_t));
+    num = arena_alloc((2 * n + 2) * sizeof(*num));
+    for (i = 0; i < n; i++) size += ENTRY_MAX - MAX_USER + orders[i].user_len;
+    entry = arena_alloc(size);
+
+    if (in_memory) {
+        for (i = 0; i < n; i++) {
+            struct level *level = get_level(&book[orders[i].which],
+                                           orders[i].price);
+            char *user = arena_alloc(orders[i].user_len + 1);
+            memcpy(user, orders[i].user, orders[i].user_len);
+            user[orders[i].user_len] = '\0';
+            push_order(level, orders[i].which, orders[i].id, user,
+                       orders[i].amount);
+        }
+    }
+
+    /* one HSET for all the orders */
+    for (i = 0, argc = 2; i < n; i++, argc += 2) {
+        snprintf(num[argc], sizeof(num[argc]), "%lld", orders[i].id);
+        snprintf(num[argc + 1], sizeof(num[argc + 1]), "%d %lld %lld",
+                 orders[i].which, orders[i].price, orders[i].amount);
+        argv[argc] = num[argc];
+        argvlen[argc] = strlen(num[argc]);
+        argv[argc + 1] = num[argc + 1];
+        argvlen[argc + 1] = strlen(num[argc + 1]);
+    }
+    snprintf(key, sizeof(key), "%sorders", key_prefix);
+    argv[0] = "HSET";
+    argvlen[0] = 4;
+    argv[1] = key;
+    argvlen[1] = strlen(key);
+    command_argv(argc, argv, argvlen);
+
+    qsort(orders, n, sizeof(struct batch_order), compare_batch_orders);
+
+    for (i = 0; i < n; i = j) {
+        const char *cmd = side_key[orders[i].which];
+
+        /* one ZADD for all the prices of a side */
+        for (j = i, argc = 2; j < n && orders[j].which == orders[i].which;
+             j++) {
+            if (j > i && orders[j].price == orders[j - 1].price) continue;
+            snprintf(num[argc], sizeof(num[argc]), "%lld", orders[j].price);
+            argv[argc] = num[argc];
+            argvlen[argc] = strlen(num[argc]);
+            argv[argc + 1] = argv[argc];
+            argvlen[argc + 1] = argvlen[argc];
+            argc += 2;
+        }
+        snprintf(key, sizeof(key), "%s_prices", cmd);
+        argv[0] = "ZADD";
+        argvlen[0] = 4;
+        argv[1] = key;
+        argvlen[1] = strlen(key);
+        command_argv(argc, argv, argvlen);
+
+        /* one RPUSH for all the orders at a price */
+        for (j = i; j < n && orders[j].which == orders[i].which; j = k) {
+            for (k = j; k < n && orders[k].which == orders[j].which &&
+                 orders[k].price == orders[j].price; k++);
+
+            snprintf(key, sizeof(key), "%s_queue@%lld", cmd, orders[j].price);
+            argv[0] = "RPUSH";
+            argvlen[0] = 5;
+            argv[1] = key;
+            argvlen[1] = strlen(key);
+            amount = 0;
+            for (argc = 2; argc - 2 < k - j; argc++) {
+                struct batch_order *order = &orders[j + argc - 2];
+                argv[argc] = entry;
+                argvlen[argc] = sprintf(entry, "%lld %.*s", order->id,
+                                        (int)order->user_len, order->user);
+                entry += argvlen[argc] + 1;
+                amount += order->amount;
+            }
+            command_argv(argc, argv, argvlen);
+
+            command("HINCRBY %s_level_amounts %lld %lld", cmd,
+                    orders[j].price, amount);
+            command("HINCRBY %s_level_counts %lld %d", cmd,
+                    orders[j].price, k - j);
+            publish_level(orders[j].which, orders[j].price);
+        }
+    }
+
+    arena_release(mark);
+}
+
+/*
+ * Read all the commands in buf[0 .. len - 1], one per line. Orders are
+ * batched, and any other command is run in place after the orders before
+ * it are written.
+ *
+ * return: the number of orders, or with --workers, the number of bid and
+ *         ask lines dispatched, as the workers parse them later and may
+ *         still reject some
+ */
+static int load_commands(const char *buf, size_t len)
+{
+    struct arena_mark mark = arena_mark();
+    struct batch_order *orders = arena_alloc(BATCH_MAX * sizeof(*orders));
+    const char *line, *end = buf + len, *tok[6];
+    size_t tok_len[6];
+    int n = 0, loaded = 0, ntok;
+
+    for (line = buf; line < end; line++) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL) eol = end;
+
+        if (n_workers > 0) {
+            /* The workers write the orders, one symbol each. */
+            ntok = split_tokens(line, eol - line, tok, tok_len, 6);
+            if (ntok > 0 && tok_len[0] == 3 &&
+                (memcmp(tok[0], "bid", 3) == 0 ||
+                 memcmp(tok[0], "ask", 3) == 0)) {
+                loaded++;
+            }
+            dispatch(line, eol - line);
+            line = eol;
+            continue;
+        }
+
+        ntok = split_tokens(line, eol - line, tok, tok_len, 6);
+        /* Orders matched on arrival cannot be reordered by price. */
+        if (!auto_match && (ntok == 4 || ntok == 5) && tok_len[0] == 3 &&
+            (memcmp(tok[0], "bid", 3) == 0 || memcmp(tok[0], "ask", 3) == 0)) {
+            struct batch_order *order;
+            const char **arg = ntok == 5 ? tok + 1 : tok;
+            size_t *arg_len = ntok == 5 ? tok_len + 1 : tok_len;
+            size_t symbol_len = ntok == 5 ? tok_len[1] : 0;
+
+            /* A batch holds the orders of one symbol. */
+            if (symbol_len != strlen(symbol) ||
+                memcmp(tok[1], symbol, symbol_len) != 0) {
+                write_batch(orders, n);
+                loaded += n;
+                n = 0;
+            }
+            order = &orders[n];
+            if (select_symbol(tok[1], symbol_len) || arg_len[1] > MAX_USER ||
+                parse_fixed(arg[2], arg_len[2], &order->price) ||
+                parse_fixed(arg[3], arg_len[3], &order->amount) ||
+                order->amount == 0) {
+                fprintf(stderr, "load: invalid order: %.*s\n",
+                        (int)(eol - line), line);
+            } else if ((order->id = new_order_id()) != 0) {
+                order->which = tok[0][0] == 'a';
+                order->seq = n;
+                order->user = arg[1];
+                order->user_len = arg_len[1];
+                if (++n == BATCH_MAX) {
+                    write_batch(orders, n);
+                    loaded += n;
+                    n = 0;
+                }
+            }
+        } else if (ntok > 0) {
+            struct arena_mark line_mark = arena_mark();
+            char *copy = arena_alloc(eol - line + 1), *argv[MAX_ARGS];
+            memcpy(copy, line, eol - line);
+            copy[eol - line] = '\0';
+            write_batch(orders, n);
+            loaded += n;
+            n = 0;
+            process_command(split_args(copy, argv, MAX_ARGS), argv);
+            arena_release(line_mark);
+        }
+        line = eol;
+    }
+    write_batch(orders, n);
+    loaded += n;
+
+    arena_release(mark);
+    return loaded;
+}
+
+/*
+ * Load the commands from fd, mapping it if it is a regular file and
+ * reading it all otherwise.
+ *
+ * return: the number of orders, or -1 on error
+ */
+static int load_fd(int fd)
+{
+    struct stat st;
+    char *buf;
+    size_t len = 0, size;
+    ssize_t r;
+    int loaded;
+    int saved_pipelined = pipelined;
+
+    pipelined = 1;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf != MAP_FAILED) {
+            madvise(buf, st.st_size, MADV_SEQUENTIAL);
+            loaded = load_commands(buf, st.st_size);
+            munmap(buf, st.st_size);
+            pipelined = saved_pipelined;
+            flush_commands();
+            return loaded;
+        }
+    }
+
+    size = 1 << 16;
+    buf = malloc(size);
+    while ((r = read(fd, buf + len, size - len)) > 0) {
+        len += r;
+        if (len == size) buf = realloc(buf, size *= 2);
+    }
+    loaded = r < 0 ? -1 : load_commands(buf, len);
+    free(buf);
+    pipelined = saved_pipelined;
+    flush_commands();
+    return loaded;
+}
+
+static void load(const char *path)
+{
+    int fd = open(path, O_RDONLY), loaded;
+
+    if (fd < 0) {
+        perror(path);
+        return;
+    }
+    loaded = load_fd(fd);
+    if (loaded < 0) perror(path);
+    else fprintf(output, "%d\n", loaded);
+    close(fd);
+}
+
+/*
+ * Snapshots (snapshot FILE, restore FILE)
+ *
+ * A snapshot is an image of the live orders of a book in one file:
+ *
+ *     "BOOKSNAP", a version byte, then market_seq, the largest order ID,
+ *     and the numbers of bid and ask orders as little-endian 64-bit
+ *     integers, then each order as ID, PRICE, and AMOUNT, followed by USER
+ *     as a length byte and the name, bids before asks, each side in
+ *     ascending order of price and then in queue order.
+ *
+ * market_seq is read before the book, so applying the market messages
+ * after it to the snapshot brings the copy up to date. restore prints it
+ * after the number of orders.
+ */
+
+#define SNAPSHOT_MAGIC "BOOKSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER (8 + 1 + 4 * 8)
+
+/*
+ * return: the value of an integer key, or 0 if it does not exist
+ */
+static long long get_counter(const char *key)
+{
+    redisReply *reply = query("GET %s", key);
+    long long value = reply->type == REDIS_REPLY_STRING ?
+                      strtoll(reply->str, NULL, 10) : 0;
+
+    freeReplyObject(reply);
+    return value;
+}
+
+/*
+ * Write the current book to path. Without --memory, the book is read from
+ * Redis the way --memory loads it.
+ */
+static void snapshot(const char *path)
+{
+    struct side sides[2] = {{0}}, *saved_book = book;
+    struct order_index index = {0}, *saved_index = orders_index;
+    char tmp[PATH_MAX], buf[TRADE_RECORD_MAX], key[64], *p;
+    long long count[2] = {0, 0}, max_id = 0, seq;
+    struct order *order;
+    int which, i;
+    FILE *fp;
+
+    snprintf(key, sizeof(key), "%smarket_seq", key_prefix);
+    seq = get_counter(key);
+    if (!in_memory) {
+        book = sides;
+        orders_index = &index;
+        engine_load();
+    }
+    for (which = 0; which < 2; which++) {
+        for (i = 0; i < book[which].n; i++) {
+            for (order = book[which].levels[i].head; order;
+                 order = order->next) {
+                if (order->cancelled) continue;
+                count[which]++;
+                if (order->id > max_id) max_id = order->id;
+            }
+        }
+    }
+
+    /* written aside and renamed, so path is never half a snapshot */
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        perror(tmp);
+    } else {
+        p = buf;
+        memcpy(p, SNAPSHOT_MAGIC, 8);
+        p += 8;
+        *p++ = SNAPSHOT_VERSION;
+        p = pack_int(p, seq);
+        p = pack_int(p, max_id);
+        p = pack_int(p, count[0]);
+        p = pack_int(p, count[1]);
+        fwrite(buf, 1, p - buf, fp);
+        for (which = 0; which < 2; which++) {
+            for (i = 0; i < book[which].n; i++) {
+                for (order = book[which].levels[i].head; order;
+                     order = order->next) {
+                    if (order->cancelled) continue;
+                    p = pack_int(buf, order->id);
+                    p = pack_int(p, order->price);
+                    p = pack_int(p, order->amount);
+                    p = pack_str(p, order->user, strlen(order->user));
+                    fwrite(buf, 1, p - buf, fp);
+                }
+            }
+        }
+        if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+            perror(path);
+            unlink(tmp);
+        } else {
+            fprintf(output, "%lld\n", count[0] + count[1]);
+        }
+    }
+
+    if (!in_memory) {
+        engine_clear();
+        free(sides[0].levels);
+        free(sides[1].levels);
+        free(index.slots);
+        book = saved_book;
+        orders_index = saved_index;
+    }
+}
+
+/*
+ * Raise order_ids to at least id, so that no new order takes an ID in a
+ * restored book.
+ */
+static void reserve_order_ids(long long id)
+{
+    freeReplyObject(query(
+        "EVAL %s 1 order_ids %lld",
+        "if tonumber(redis.call('GET', KEYS[1]) or 0) < tonumber(ARGV[1]) "
+        "then redis.call('SET', KEYS[1], ARGV[1]) end", id));
+    /* The next order reserves a fresh block above id. */
+    next_id = last_id;
+    atomic_fetch_add(&id_generation, 1);
+}
+
+/*
+ * Read the order at p of a snapshot ending at end, whose orders have IDs
+ * up to max_id.
+ *
+ * return: the byte after the order, or NULL if it is cut short or invalid
+ */
+static const char *unpack_snapshot_order(const char *p, const char *end,
+                                         long long max_id,
+                                         struct batch_order *order)
+{
+    if (end - p < 3 * 8 + 1 ||
+        end - p < 3 * 8 + 1 + (unsigned char)p[3 * 8]) {
+        return NULL;
+    }
+    p = unpack_int(p, &order->id);
+    p = unpack_int(p, &order->price);
+    p = unpack_int(p, &order->amount);
+    order->user_len = (unsigned char)*p++;
+    order->user = p;
+    if (order->id <= 0 || order->id > max_id ||
+        order->price < 0 || order->price >= FIXED_MAX ||
+        order->amount <= 0 || order->amount >= FIXED_MAX) {
+        return NULL;
+    }
+    return p + order->user_len;
+}
+
+/*
+ * Replace the current book with the snapshot in buf[0 .. len - 1]. The
+ * whole snapshot is checked before the book is touched, so a truncated or
+ * corrupt file leaves it as it was.
+ *
+ * return: the number of orders, or -1 if buf is not a snapshot
+ */
+static long long restore_snapshot(const char *buf, size_t len,
+                                  long long *seq)
+{
+    const char *p = buf, *end = buf + len, *orders_start;
+    struct arena_mark mark;
+    struct batch_order *orders;
+    long long max_id, count[2], i;
+    int which, n = 0;
+
+    if (len < SNAPSHOT_HEADER || memcmp(p, SNAPSHOT_MAGIC, 8) != 0 ||
+        p[8] != SNAPSHOT_VERSION) {
+        return -1;
+    }
+    p += 9;
+    p = unpack_int(p, seq);
+    p = unpack_int(p, &max_id);
+    p = unpack_int(p, &count[0]);
+    p = unpack_int(p, &count[1]);
+    if (count[0] < 0 || count[1] < 0) return -1;
+
+    orders_start = p;
+    for (i = 0; i < count[0] + count[1]; i++) {
+        struct batch_order order;
+        p = unpack_snapshot_order(p, end, max_id, &order);
+        if (p == NULL) return -1;
+    }
+    if (p != end) return -1;
+
+    mark = arena_mark();
+    orders = arena_alloc(BATCH_MAX * sizeof(*orders));
+    if (in_memory) engine_clear();
+    clear();
+    reserve_order_ids(max_id);
+    p = orders_start;
+    for (which = 0; which < 2; which++) {
+        for (i = 0; i < count[which]; i++) {
+            struct batch_order *order = &orders[n];
+            p = unpack_snapshot_order(p, end, max_id, order);
+            order->which = which;
+            order->seq = n;
+            if (++n == BATCH_MAX) {
+                write_batch(orders, n);
+                n = 0;
+            }
+        }
+    }
+    write_batch(orders, n);
+    arena_release(mark);
+    return count[0] + count[1];
+}
+
+static void restore(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    int saved_pipelined = pipelined;
+    struct stat st;
+    char *buf;
+    long long restored, seq;
+
+    if (fd < 0) {
+        perror(path);
+        return;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: not a snapshot\n", path);
+        close(fd);
+        return;
+    }
+    buf = mmap(NULL, st.st_size ? st.st_size : 1, PROT_READ, MAP_PRIVATE,
+               fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        perror(path);
+        return;
+    }
+    madvise(buf, st.st_size, MADV_SEQUENTIAL);
+    pipelined = 1;
+    restored = restore_snapshot(buf, st.st_size, &seq);
+    pipelined = saved_pipelined;
+    flush_commands();
+    munmap(buf, st.st_size ? st.st_size : 1);
+    if (restored < 0) fprintf(stderr, "%s: not a snapshot\n", path);
+    else fprintf(output, "%lld %lld\n", restored, seq);
+}
+
+/*
+ * return: 1 if argv[1] is the SYMBOL of the command
+ */
+static int has_symbol(int argc, char **argv)
+{
+    if (strcmp(argv[0], "bid") == 0 || strcmp(argv[0], "ask") == 0) {
+        return argc == 5;
+    }
+    if (strcmp(argv[0], "snapshot") == 0 || strcmp(argv[0], "restore") == 0) {
+        return argc == 3;
+    }
+    if (strcmp(argv[0], "load") == 0 || strcmp(argv[0], "help") == 0 ||
+        strcmp(argv[0], "serve") == 0 || strcmp(argv[0], "stats") == 0) {
+        return 0;
+    }
+    return argc > 1 && isalpha((unsigned char)argv[1][0]);
+}
+
+/*
+ * Binary Protocol (--binary)
+ *
+ * With --binary, stdin and the clients of serve send fixed-layout messages
+ * instead of lines, and every message is answered by a fixed-layout reply,
+ * so an order reaches the book without any text formatted or parsed. All
+ * integers are little-endian. A message is a MESSAGE_SIZE-byte header
+ * followed by the symbol and the user:
+ *
+ *     offset  size  field
+ *     0       1     type: 'N' new order, 'C' cancel, 'A' amend, 'M' match
+ *     1       1     side of N: 0 for a bid, 1 for an ask
+ *     2       1     length of the symbol, 0 for the default book
+ *     3       1     length of the user of N
+ *     4       4     reserved
+ *     8       8     ID of the order of C and A
+ *     16      8     price of N, in ticks of 1 / FIXED_ONE
+ *     24      8     amount of N and A, in lots of 1 / FIXED_ONE
+ *
+ * A reply has REPLY_SIZE bytes:
+ *
+ *     0       1     type of the message
+ *     1       1     status: REPLY_OK or an error below
+ *     2       6     reserved
+ *     8       8     N: the ID of the order, C and A: 1 if done or 0 if
+ *                   there is no such order, M: the number of trades
+ */
+
+#define MESSAGE_SIZE 32
+#define REPLY_SIZE 16
+
+enum {
+    REPLY_OK,
+    REPLY_INVALID,          /* a bad type, side, symbol, user, or number */
+    REPLY_TOO_LARGE,        /* the amount of A exceeds the amount left */
+    REPLY_FAILED            /* Redis failed to allocate the ID of N, or
+                               could not be reached */
+};
+
+/*
+ * return: the length of the message at the start of buf[0 .. len - 1], or
+ *         0 if it is not complete yet
+ */
+static size_t message_length(const char *buf, size_t len)
+{
+    size_t n;
+
+    if (len < MESSAGE_SIZE) return 0;
+    n = MESSAGE_SIZE + (unsigned char)buf[2] + (unsigned char)buf[3];
+    return n <= len ? n : 0;
+}
+
+/*
+ * return: 1 if msg can run on async_context, like is_async()
+ */
+static int is_async_message(const char *msg)
+{
+    return msg[0] == 'N' && !auto_match;
+}
+
+/*
+ * Run the message msg, which message_length() has found complete.
+ *
+ * value: set to the value of the reply
+ * return: the status of the reply
+ */
+static int run_message(const char *msg, long long *value)
+{
+    size_t symbol_len = (unsigned char)msg[2];
+    size_t user_len = (unsigned char)msg[3];
+    const char *name = msg + MESSAGE_SIZE;
+    char user[MAX_USER + 1];
+    long long id, price, amount;
+    int done;
+
+    unpack_int(unpack_int(unpack_int(msg + 8, &id), &price), &amount);
+    if (select_symbol(name, symbol_len)) return REPLY_INVALID;
+    switch (msg[0]) {
+    case 'N':
+        if (msg[1] != 0 && msg[1] != 1) return REPLY_INVALID;
+        if (user_len == 0 || memchr(name + symbol_len, '\0', user_len)) {
+            return REPLY_INVALID;
+        }
+        if (price < 0 || price >= FIXED_MAX || amount <= 0 ||
+            amount >= FIXED_MAX) {
+            return REPLY_INVALID;
+        }
+        memcpy(user, name + symbol_len, user_len);
+        user[user_len] = '\0';
+        *value = in_memory ? engine_bid_ask(msg[1], user, price, amount) :
+                             bid_ask(msg[1], user, price, amount);
+        return *value ? REPLY_OK : REPLY_FAILED;
+    case 'C':
+    case 'A':
+        if (id <= 0 || amount < 0 || amount >= FIXED_MAX) {
+            return REPLY_INVALID;
+        }
+        if (msg[0] == 'C') amount = 0;
+        done = in_memory ? engine_amend(id, amount) : amend(id, amount);
+        if (done < 0) return REPLY_TOO_LARGE;
+        *value = done;
+        return REPLY_OK;
+    case 'M':
+        *value = in_memory ? engine_match() :
+                 lua_match ? match_lua() : match();
+        return REPLY_OK;
+    }
+    return REPLY_INVALID;
+}
+
+static int check_connection();
+
+/*
+ * The same as process_command() for the message msg.
+ */
+static void process_message(const char *msg)
+{
+    int op = msg[0] == 'N' ? STAT_BID_ASK :
+             msg[0] == 'C' || msg[0] == 'A' ? STAT_AMEND :
+             msg[0] == 'M' ? STAT_MATCH : -1;
+    struct arena_mark mark = arena_mark();
+    long long start = op < 0 ? 0 : stat_begin(op), value = 0;
+    char reply[REPLY_SIZE] = {msg[0]};
+
+    check_connection();
+    reply[1] = run_message(msg, &value);
+    pack_int(reply + 8, value);
+    fwrite(reply, 1, REPLY_SIZE, output);
+    if (op >= 0) stat_end(op, start);
+    arena_release(mark);
+}
+
+static void dispatch_message(const char *msg, size_t len);
+
+/*
+ * Run the messages read from fd until its end, with --workers passing each
+ * to the worker of its symbol.
+ */
+static void read_messages(int fd)
+{
+    char buf[65536];
+    size_t len = 0, done, n;
+    ssize_t r;
+
+    while ((r = read(fd, buf + len, sizeof(buf) - len)) != 0) {
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            perror("read");
+            break;
+        }
+        len += r;
+        for (done = 0; (n = message_length(buf + done, len - done)) > 0;
+             done += n) {
+            if (n_workers > 0) dispatch_message(buf + done, n);
+            else process_message(buf + done);
+        }
+        /* The writes of the messages read at once share a round trip,
+           which is done before they are answered. */
+        if (!in_memory) flush_commands();
+        fflush(output);
+        len -= done;
+        memmove(buf, buf + done, len);
+    }
+    if (len > 0) fprintf(stderr, "incomplete message at the end\n");
+}
+
+/*
+ * Workers (--workers N)
+ *
+ * Each symbol is owned by one of N worker threads, chosen by the hash of
+ * the symbol, and each worker has its own Redis connection and in-memory
+ * books. main() only reads the commands and passes them through a
+ * single-producer single-consumer ring to the owning worker, so the
+ * commands of a symbol run in order, and those of unrelated symbols never
+ * wait for each other. The result of a command is printed at once when it
+ * is done.
+ */
+
+#define RING_SIZE 1024
+
+/*
+ * A command line split in place, or a message of --binary if argc is -1,
+ * which is freed by the worker.
+ */
+struct job {
+    int argc;
+    char *argv[MAX_ARGS];
+    char line[];
+};
+
+struct worker {
+    pthread_t thread;
+    struct job *ring[RING_SIZE];
+    atomic_size_t head;     /* next job to run, written by the worker */
+    atomic_size_t tail;     /* next free slot, written by main() */
+    sem_t jobs;             /* number of jobs in ring, to sleep on */
+    int pipelined;
+};
+
+static struct worker *workers;
+
+/*
+ * Split [HOST:]PORT for hiredis, which takes the port as a number.
+ *
+ * return: 0 on success, -1 on error
+ */
+static int split_host_port(const char *address, char *host, size_t size,
+                           int *port)
+{
+    const char *service;
+
+    if (split_address(address, host, size, &service)) return -1;
+    *port = atoi(service);
+    if (*port <= 0 || *port > 65535) {
+        fprintf(stderr, "%s: bad port\n", address);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Connect to address, with --timeout for the connect and every command
+ * after it, so that a Redis which stops answering fails the command
+ * instead of hanging the process.
+ */
+static redisContext *connect_redis(const char *address)
+{
+    struct timeval tv = {redis_timeout_ms / 1000,
+                         redis_timeout_ms % 1000 * 1000};
+    int unix_socket = strchr(address, '/') != NULL, port;
+    char host[256];
+    redisContext *c;
+
+    if (unix_socket) {
+        c = redis_timeout_ms ? redisConnectUnixWithTimeout(address, tv)
+                             : redisConnectUnix(address);
+    } else {
+        if (split_host_port(address, host, sizeof(host), &port)) {
+            return NULL;
+        }
+        c = redis_timeout_ms ? redisConnectWithTimeout(host, port, tv)
+                             : redisConnect(host, port);
+    }
+    if (c == NULL) {
+        fprintf(stderr, "redisConnect failed\n");
+        return NULL;
+    }
+    if (c->err) {
+        fprintf(stderr, "redisConnect %s: %s\n", address, c->errstr);
+        redisFree(c);
+        return NULL;
+    }
+    if (redis_timeout_ms) redisSetTimeout(c, tv);
+    /* to notice a peer gone while the connection is idle */
+    if (!unix_socket) redisEnableKeepAlive(c);
+    return c;
+}
+
+/*
+ * hiredis leaves a context unusable after an I/O error, so replace it with
+ * a new connection before the next command. The replies still pending are
+ * lost, and with --memory so are the written-behind changes among them.
+ *
+ * return: 0 if context can be used, -1 if Redis is still unreachable
+ */
+static int check_connection()
+{
+    redisContext *c;
+
+    if (context->err == 0) return 0;
+    fprintf(stderr, "redis: %s, reconnecting\n", context->errstr);
+    c = connect_redis(redis_address);
+    if (c == NULL) return -1;
+    redisFree(context);
+    context = c;
+    pending = 0;
+    unsent = 0;
+    appended = 0;
+    free_script_queue(&queued_scripts);
+    /* the scripts are loaded again, in case Redis restarted */
+    script_generation++;
+    return 0;
+}
+
+/*
+ * A connection of this thread to replica_addresses[i].
+ */
+struct replica {
+    redisContext *context;
+    long long checked;      /* when it was last connected or checked, in ns */
+    int fresh;              /* within --max-lag at the last check */
+};
+
+static __thread struct replica replicas[MAX_REPLICAS];
+static __thread int next_replica;
+
+/*
+ * Check the lag of r at most once a second with INFO replication. A
+ * replica without its primary, or which has not heard from it in
+ * --max-lag seconds, is not fresh.
+ */
+static int replica_fresh(struct replica *r)
+{
+    redisReply *reply;
+    const char *io;
+    long long now = now_ns();
+
+    if (replica_max_lag < 0) return 1;
+    if (now - r->checked < NS_PER_SEC) return r->fresh;
+    r->checked = now;
+    reply = redisCommand(r->context, "INFO replication");
+    if (reply == NULL) return r->fresh = 0;
+    if (reply->type != REDIS_REPLY_STRING) {
+        r->fresh = 0;
+    } else if (strstr(reply->str, "role:master")) {
+        /* The replica has been promoted. */
+        r->fresh = 1;
+    } else {
+        io = strstr(reply->str, "master_last_io_seconds_ago:");
+        r->fresh = strstr(reply->str, "master_link_status:up") && io &&
+                   atoi(io + 27) <= replica_max_lag;
+    }
+    freeReplyObject(reply);
+    return r->fresh;
+}
+
+/*
+ * Take the next fresh replica in turns, connecting to it if needed. One
+ * which could not be reached is tried again a second later.
+ *
+ * return: its context, or NULL to read from the primary
+ */
+static redisContext *pick_replica()
+{
+    int i;
+
+    for (i = 0; i < n_replicas; i++) {
+        struct replica *r = &replicas[next_replica];
+        const char *address = replica_addresses[next_replica];
+
+        next_replica = (next_replica + 1) % n_replicas;
+        if (r->context && r->context->err) {
+            fprintf(stderr, "%s: %s\n", address, r->context->errstr);
+            redisFree(r->context);
+            r->context = NULL;
+        }
+        if (r->context == NULL) {
+            long long now = now_ns();
+            if (r->checked && now - r->checked < NS_PER_SEC) continue;
+            r->checked = now;
+            r->context = connect_redis(address);
+            if (r->context == NULL) continue;
+            /* Check the lag before the first read. */
+            r->checked = 0;
+        }
+        if (replica_fresh(r)) return r->context;
+    }
+    return NULL;
+}
+
+static void close_replicas()
+{
+    int i;
+
+    for (i = 0; i < n_replicas; i++) {
+        if (replicas[i].context) redisFree(replicas[i].context);
+        replicas[i].context = NULL;
+    }
+}
+
+/*
+ * return: 1 if cmd only reads the book from Redis, so that it can go to
+ *         a replica
+ */
+static int is_replica_read(const char *cmd)
+{
+    if (n_replicas == 0) return 0;
+    if (strcmp(cmd, "history") == 0 || strcmp(cmd, "candles") == 0) {
+        return 1;
+    }
+    /* --memory answers these without Redis. */
+    return !in_memory &&
+           (strcmp(cmd, "list") == 0 || strcmp(cmd, "depth") == 0);
+}
+
+/*
+ * Pass job to worker, or NULL to stop it. Only main() pushes.
+ */
+static void push_job(struct worker *worker, struct job *job)
+{
+    size_t tail = atomic_load_explicit(&worker->tail, memory_order_relaxed);
+
+    while (tail - atomic_load_explicit(&worker->head, memory_order_acquire) ==
+           RING_SIZE) {
+        sched_yield();
+    }
+    worker->ring[tail % RING_SIZE] = job;
+    atomic_store_explicit(&worker->tail, tail + 1, memory_order_release);
+    sem_post(&worker->jobs);
+}
+
+static struct job *pop_job(struct worker *worker)
+{
+    size_t head = atomic_load_explicit(&worker->head, memory_order_relaxed);
+    struct job *job;
+
+    if (sem_trywait(&worker->jobs) != 0) {
+        /* Idle: let the written-behind changes reach Redis. */
+        flush_commands();
+        while (sem_wait(&worker->jobs) != 0);
+    }
+    job = worker->ring[head % RING_SIZE];
+    atomic_store_explicit(&worker->head, head + 1, memory_order_release);
+    return job;
+}
+
+static void *run_worker(void *arg)
+{
+    struct worker *worker = arg;
+    struct job *job;
+    char *buf = NULL;
+    size_t len = 0;
+
+    pipelined = worker->pipelined;
+    context = connect_redis(redis_address);
+    /* one stream for the output of all the commands, rewound after each */
+    output = open_memstream(&buf, &len);
+    while ((job = pop_job(worker)) != NULL) {
+        /* Redis was down when the worker started. */
+        if (context == NULL) context = connect_redis(redis_address);
+        if (context == NULL) {
+            /* answered all the same, so that the replies stay in step */
+            if (job->argc < 0) {
+                char reply[REPLY_SIZE] = {job->line[0], REPLY_FAILED};
+                fwrite(reply, 1, REPLY_SIZE, output);
+            } else {
+                fputs("error: Redis is unreachable\n", output);
+            }
+        } else if (job->argc < 0) {
+            process_message(job->line);
+        } else {
+            process_command(job->argc, job->argv);
+        }
+        fflush(output);
+        if (len > 0) fwrite(buf, 1, len, stdout);
+        fseeko(output, 0, SEEK_SET);
+        fflush(output);
+        free(job);
+        if (context && !in_memory) flush_commands();
+    }
+    fclose(output);
+    free(buf);
+    close_replicas();
+    if (context) {
+        flush_commands();
+        redisFree(context);
+    }
+    return NULL;
+}
+
+/*
+ * return: 0 on success, -1 on error
+ */
+static int start_workers()
+{
+    int i;
+
+    workers = calloc(n_workers, sizeof(struct worker));
+    for (i = 0; i < n_workers; i++) {
+        sem_init(&workers[i].jobs, 0, 0);
+        workers[i].pipelined = pipelined;
+    }
+    for (i = 0; i < n_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, run_worker,
+                           &workers[i])) {
+            perror("pthread_create");
+            n_workers = i;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void stop_workers()
+{
+    int i;
+
+    for (i = 0; i < n_workers; i++) push_job(&workers[i], NULL);
+    for (i = 0; i < n_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        sem_destroy(&workers[i].jobs);
+    }
+    free(workers);
+}
+
+/*
+ * FNV-1a
+ */
+static unsigned hash_symbol(const char *symbol)
+{
+    unsigned h = 2166136261u;
+
+    for (; *symbol; symbol++) h = (h ^ (unsigned char)*symbol) * 16777619u;
+    return h;
+}
+
+/*
+ * Pass the command in line[0 .. len - 1] to the worker of its symbol. load
+ * is run here, passing each of its commands in turn.
+ */
+static void dispatch(const char *line, size_t len)
+{
+    struct job *job = malloc(sizeof(struct job) + len + 1);
+
+    memcpy(job->line, line, len);
+    job->line[len] = '\0';
+    job->argc = split_args(job->line, job->argv, MAX_ARGS);
+    if (job->argc == 0) {
+        free(job);
+    } else if (job->argc == 2 && strcmp(job->argv[0], "load") == 0) {
+        load(job->argv[1]);
+        free(job);
+    } else {
+        const char *name = has_symbol(job->argc, job->argv) ? job->argv[1]
+                                                            : "";
+        push_job(&workers[hash_symbol(name) % n_workers], job);
+    }
+}
+
+/*
+ * Pass the message msg[0 .. len - 1] to the worker of its symbol.
+ */
+static void dispatch_message(const char *msg, size_t len)
+{
+    struct job *job = malloc(sizeof(struct job) + len);
+    char name[256];
+
+    memcpy(job->line, msg, len);
+    job->argc = -1;
+    memcpy(name, msg + MESSAGE_SIZE, (unsigned char)msg[2]);
+    name[(unsigned char)msg[2]] = '\0';
+    push_job(&workers[hash_symbol(name) % n_workers], job);
+}
+
+/*
+ * Server (serve ADDRESS)
+ *
+ * serve accepts clients on a TCP port or a Unix socket and runs the
+ * commands they send, one per line, answering each with what the REPL
+ * would print, or the messages of --binary, answering each with a reply.
+ * A single epoll loop serves all the clients: the commands of all the
+ * clients ready at once are run in turn with their Redis writes
+ * pipelined, and the whole batch is flushed in one round trip before any
+ * of them is answered.
+ */
+
+/* the longest command line a client may send */
+#define MAX_LINE 65536
+
+#define MAX_EVENTS 64
+
+struct client {
+    int fd;
+    unsigned events;        /* the epoll events waited for */
+    int eof;                /* the client has sent everything */
+    int closed;             /* fd is closed, waiting for its requests */
+    int dirty;              /* in dirty_clients */
+    char in[MAX_LINE];
+    size_t in_len;
+    FILE *stream;           /* output of the commands, into out */
+    char *out;
+    size_t out_len, out_sent;
+    struct request *head, *tail;    /* requests of --async in order */
+    int http;               /* a scrape of --metrics */
+};
+
+/*
+ * With --async, a command whose answer comes later from async_context. Its
+ * output is kept until the commands before it are answered.
+ */
+struct request {
+    struct request *next;
+    struct client *client;
+    int running;            /* in process_command() */
+    int waiting;            /* replies from async_context to wait for */
+    int failed;             /* a write of it failed */
+    int offset, limit;      /* of depth */
+    FILE *stream;
+    char *out;
+    size_t out_len;
+};
+
+/* the clients with something new to send */
+static struct client **dirty_clients;
+static int n_dirty, dirty_size;
+
+static int serving = 0;
+
+/* --metrics: also serve the statistics over HTTP on this address */
+static const char *metrics_address;
+static int metrics_listener = -1;
+
+/*
+ * Listen on address: a path containing '/' for a Unix socket, [HOST:]PORT
+ * otherwise. HOST defaults to the loopback address.
+ *
+ * return: the non-blocking listening socket, or -1 on error
+ */
+static int listen_on(const char *address)
+{
+    const char *port;
+    char host[256];
+    struct addrinfo hints, *res, *ai;
+    int fd = -1, on = 1, err;
+
+    if (strchr(address, '/')) {
+        struct sockaddr_un sun;
+        struct stat st;
+
+        if (strlen(address) >= sizeof(sun.sun_path)) {
+            fprintf(stderr, "%s: path too long\n", address);
+            return -1;
+        }
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, address);
+        /* a socket left by a previous server */
+        if (stat(address, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(address);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) ||
+            listen(fd, SOMAXCONN)) {
+            perror(address);
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    if (split_address(address, host, sizeof(host), &port)) return -1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    err = getaddrinfo(host, port, &hints, &res);
+    if (err) {
+        fprintf(stderr, "%s: %s\n", address, gai_strerror(err));
+        return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK,
+                    ai->ai_protocol);
+        if (fd < 0) continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(fd, SOMAXCONN) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) perror(address);
+    freeaddrinfo(res);
+    return fd;
+}
+
+static void mark_dirty(struct client *c)
+{
+    if (c->dirty || c->closed) return;
+    if (n_dirty == dirty_size) {
+        dirty_size = dirty_size ? dirty_size * 2 : MAX_EVENTS;
+        dirty_clients = realloc(dirty_clients,
+                                dirty_size * sizeof(*dirty_clients));
+    }
+    dirty_clients[n_dirty++] = c;
+    c->dirty = 1;
+}
+
+/*
+ * Close the socket of c, and free c once its requests are answered.
+ */
+static void close_client(struct client *c)
+{
+    if (!c->closed) {
+        close(c->fd);
+        c->closed = 1;
+    }
+    if (c->head || c->dirty) return;
+    fclose(c->stream);
+    free(c->out);
+    free(c);
+}
+
+/* answered requests kept with their streams for the next ones */
+static struct request *free_requests;
+
+/*
+ * return: a request of c, running
+ */
+static struct request *new_request(struct client *c)
+{
+    struct request *req = free_requests;
+
+    if (req) {
+        free_requests = req->next;
+    } else {
+        req = calloc(1, sizeof(struct request));
+        req->stream = open_memstream(&req->out, &req->out_len);
+    }
+    req->next = NULL;
+    req->client = c;
+    req->running = 1;
+    req->waiting = 0;
+    req->failed = 0;
+    return req;
+}
+
+static void free_request(struct request *req)
+{
+    /* Start over at the beginning of the buffer. */
+    fseeko(req->stream, 0, SEEK_SET);
+    fflush(req->stream);
+    req->next = free_requests;
+    free_requests = req;
+}
+
+/*
+ * Move the output of the answered requests at the head of c to c->stream.
+ */
+static void deliver(struct client *c)
+{
+    while (c->head && !c->head->running && !c->head->waiting) {
+        struct request *req = c->head;
+        c->head = req->next;
+        if (c->head == NULL) c->tail = NULL;
+        fflush(req->stream);
+        fwrite(req->out, 1, req->out_len, c->stream);
+        free_request(req);
+    }
+    fflush(c->stream);
+    if (c->closed) close_client(c);
+    else mark_dirty(c);
+}
+
+/*
+ * Async Execution (serve --async)
+ *
+ * async_context shares the epoll loop of serve through the callbacks
+ * below. bid and ask send their writes on it without waiting, and are
+ * answered once Redis has replied to all of them. depth, list, history,
+ * and match (with --lua) are each sent as one command whose reply is
+ * written by a callback, so the commands of all the clients are in flight
+ * at once. Any other command waits for all of them, and then
+ * runs on context as usual.
+ */
+
+static int serve_ep = -1;
+
+/* the events of async_context->c.fd in serve_ep */
+static unsigned async_events;
+
+static void async_set_events(unsigned events)
+{
+    struct epoll_event ev;
+
+    if (events == async_events || async_context == NULL) return;
+    ev.events = events;
+    ev.data.ptr = &async_context;
+    epoll_ctl(serve_ep, async_events == 0 ? EPOLL_CTL_ADD :
+                        events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD,
+              async_context->c.fd, &ev);
+    async_events = events;
+}
+
+static void async_add_read(void *privdata)
+{
+    async_set_events(async_events | EPOLLIN);
+}
+
+static void async_del_read(void *privdata)
+{
+    async_set_events(async_events & ~EPOLLIN);
+}
+
+static void async_add_write(void *privdata)
+{
+    async_set_events(async_events | EPOLLOUT);
+}
+
+static void async_del_write(void *privdata)
+{
+    async_set_events(async_events & ~EPOLLOUT);
+}
+
+static void async_cleanup(void *privdata)
+{
+    async_set_events(0);
+}
+
+static void async_disconnected(const redisAsyncContext *ac, int status)
+{
+    if (status != REDIS_OK) fprintf(stderr, "async: %s\n", ac->errstr);
+    async_context = NULL;
+    async_events = 0;
+    async_pending = 0;
+}
+
+static int async_connect()
+{
+    char host[256];
+    int port;
+
+    if (strchr(redis_address, '/')) {
+        async_context = redisAsyncConnectUnix(redis_address);
+    } else if (split_host_port(redis_address, host, sizeof(host), &port)) {
+        return -1;
+    } else {
+        async_context = redisAsyncConnect(host, port);
+    }
+    if (async_context == NULL || async_context->err) {
+        fprintf(stderr, "redisAsyncConnect: %s\n",
+                async_context ? async_context->errstr : "failed");
+        if (async_context) redisAsyncFree(async_context);
+        async_context = NULL;
+        return -1;
+    }
+    async_context->ev.addRead = async_add_read;
+    async_context->ev.delRead = async_del_read;
+    async_context->ev.addWrite = async_add_write;
+    async_context->ev.delWrite = async_del_write;
+    async_context->ev.cleanup = async_cleanup;
+    redisAsyncSetDisconnectCallback(async_context, async_disconnected);
+    return 0;
+}
 
 /*
- * Convert a binary-safe string into a null-terminated string.
- *
- * reply->str: a binary-safe string
- * return: a null-terminated string, which is available until the next call.
+ * Wait for the replies of all the commands sent on async_context.
  */
-static const char *get_reply_str(redisReply *reply)
+static void async_drain()
 {
-    static int len = 0;
-    static char *str = NULL;
+    struct pollfd pfd;
 
-    if (reply->type != REDIS_REPLY_STRING) return NULL;
-    if (reply->len + 1 > len) {
-        len = reply->len + 1;
-        str = realloc(str, len);
+    while (async_context && async_pending > 0) {
+        pfd.fd = async_context->c.fd;
+        pfd.events = POLLIN | (async_events & EPOLLOUT ? POLLOUT : 0);
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return;
+        }
+        if (pfd.revents & POLLOUT) redisAsyncHandleWrite(async_context);
+        if (async_context && (pfd.revents & (POLLIN | POLLERR | POLLHUP))) {
+            redisAsyncHandleRead(async_context);
+        }
     }
-    memcpy(str, reply->str, reply->len);
-    str[reply->len] = '\0';
-    return str;
 }
 
-static inline double get_reply_double(redisReply *reply)
+/*
+ * return: 1 if the command can run on async_context
+ */
+static int is_async(int argc, char **argv)
 {
-    return atof(get_reply_str(reply));
+    const char *cmd = argv[0];
+    int i;
+
+    if (argc == 0) return 0;
+    if (strcmp(cmd, "bid") == 0 || strcmp(cmd, "ask") == 0) {
+        /* Matching on arrival reads the book between the writes. */
+        return !auto_match;
+    }
+    if (strcmp(cmd, "match") == 0) return lua_match;
+    /* async_context is on the primary. */
+    if (is_replica_read(cmd)) return 0;
+    if (strcmp(cmd, "history") == 0) {
+        /* Only the plain one is sent as one command. */
+        for (i = 1; i < argc; i++) {
+            if (strncmp(argv[i], "--", 2) == 0) return 0;
+        }
+        return 1;
+    }
+    return strcmp(cmd, "list") == 0 || strcmp(cmd, "depth") == 0;
 }
 
 /*
- * Add an order.
- *
- * cmd: "bid" or "ask"
+ * Start waiting for a reply to the current request.
  */
-static void bid_ask(const char *cmd, const char *user,
-                    double price, double amount)
+static struct request *async_wait()
 {
-    redisReply *reply;
-    reply = redisCommand(context, "ZADD %s_prices %f %f", cmd, price, price);
-    freeReplyObject(reply);
-    reply = redisCommand(context, "RPUSH %s_users@%f %s", cmd, price, user);
-    freeReplyObject(reply);
-    reply = redisCommand(context, "RPUSH %s_amounts@%f %f", cmd, price, amount);
-    freeReplyObject(reply);
+    count_commands(1, 1);
+    async_request->waiting++;
+    async_pending++;
+    return async_request;
 }
 
 /*
- * Remove all data in Redis.
+ * Count a write of the current request sent on async_context.
  */
-static void clear()
+static void async_write_sent()
 {
-    redisReply *prices, *reply;
-    int which, i;
-    const char *bid_ask_str[2] = {"bid", "ask"};
+    async_request->waiting++;
+    async_pending++;
+}
 
-    for (which = 0; which < 2; which++) {
-        prices = redisCommand(context, "ZRANGE %s_prices 0 -1",
-                              bid_ask_str[which]);
-        for (i = 0; i < prices->elements; i++) {
-            const char *price = get_reply_str(prices->element[i]);
-            reply = redisCommand(context, "DEL %s_users@%s %s_amounts@%s",
-                                 bid_ask_str[which], price,
-                                 bid_ask_str[which], price);
-            freeReplyObject(reply);
+/*
+ * Take the reply to a write of req. The answer of req is held until all
+ * of its writes are answered, and becomes an error if any of them failed
+ * (with --binary, the status REPLY_FAILED).
+ */
+static void async_write_done(struct request *req, redisReply *reply)
+{
+    async_pending--;
+    req->waiting--;
+    if ((reply == NULL || reply->type == REDIS_REPLY_ERROR) && !req->failed) {
+        req->failed = 1;
+        fflush(req->stream);
+        if (binary) {
+            if (req->out_len >= REPLY_SIZE) {
+                req->out[1] = REPLY_FAILED;
+                memset(req->out + 8, 0, 8);
+            }
+        } else {
+            /* in place of the ID printed */
+            fseeko(req->stream, 0, SEEK_SET);
+            fprintf(req->stream, "error: %s\n", reply ? reply->str
+                                                      : "connection lost");
         }
-        freeReplyObject(prices);
-        reply = redisCommand(context, "DEL %s_prices", bid_ask_str[which]);
-        freeReplyObject(reply);
     }
-    reply = redisCommand(context, "DEL "
-                                  "matched_bidders "
-                                  "matched_bidprices "
-                                  "matched_askers "
-                                  "matched_askprices "
-                                  "matched_amounts "
-                                  "matched_timestamps");
-    freeReplyObject(reply);
+    if (req->waiting == 0) deliver(req->client);
 }
 
+/* output outside the callback running */
+static FILE *saved_output;
+
 /*
- * List all unmatched prices.
+ * Begin a callback of the request privdata.
+ *
+ * return: the request, or NULL if reply tells an error, which is then
+ *         written as the answer
  */
-static void list()
+static struct request *async_reply(void *reply, void *privdata,
+                                   int type)
 {
-    redisReply *prices, *reply;
-    json_object *list, *reqs, *row;
-    char s[20];
-    int i;
-    double total;
+    struct request *req = privdata;
+    redisReply *r = reply;
 
-    list = json_object_new_object();
+    async_pending--;
+    req->waiting--;
+    saved_output = output;
+    output = req->stream;
+    if (r == NULL || r->type != type) {
+        fprintf(output, "error: %s\n", r && r->type == REDIS_REPLY_ERROR ?
+                r->str : "bad reply");
+        return NULL;
+    }
+    return req;
+}
 
-    int which;
-    const char *get_prices_cmd[2] = {"ZRANGE bid_prices 0 -1",
-                                     "ZREVRANGE ask_prices 0 -1"},
-               *get_amounts_cmd[2] = {"LRANGE bid_amounts@%f 0 -1",
-                                      "LRANGE ask_amounts@%f 0 -1"},
-               *json_col[2] = {"bids", "asks"};
+/*
+ * End a callback of the request.
+ */
+static void async_done(struct request *req)
+{
+    output = saved_output;
+    deliver(req->client);
+}
 
-    for (which = 0; which < 2; which++) {
-        reqs = json_object_new_array();
-        prices = redisCommand(context, get_prices_cmd[which]);
-        for (total = 0, i = prices->elements - 1; i >= 0; i--) {
-            double price = get_reply_double(prices->element[i]);
-            reply = redisCommand(context, get_amounts_cmd[which], price);
-            int j;
-            double amount = 0;
-            for (j = 0; j < reply->elements; j++) {
-                amount += get_reply_double(reply->element[j]);
-            }
-            total += amount;
-
-            row = json_object_new_object();
-            snprintf(s, 20, "%zu", reply->elements);
-            json_object_object_add(row, "count", json_object_new_string(s));
-            snprintf(s, 20, "%.2lf", amount);
-            json_object_object_add(row, "amount", json_object_new_string(s));
-            snprintf(s, 20, "%.2lf", total);
-            json_object_object_add(row, "total", json_object_new_string(s));
-            snprintf(s, 20, "%.2lf", price);
-            json_object_object_add(row, "price", json_object_new_string(s));
-            json_object_array_add(reqs, row);
+/*
+ * Read the prices of depth() and their level sizes at once.
+ *
+ * KEYS[1 .. 3]: bid_prices, bid_level_amounts, and bid_level_counts
+ * KEYS[4 .. 6]: the ask version of the above keys
+ * ARGV[1]: the index of the last price to read, -1 for all
+ * return: {bid prices, their amounts, their counts, ask prices, ...}
+ */
+static __thread struct script depth_script = {
+    "local stop = tonumber(ARGV[1])\n"
+    "local result = {}\n"
+    "for side = 0, 1 do\n"
+    "    local z = side == 0 and 'ZREVRANGE' or 'ZRANGE'\n"
+    "    local prices = redis.call(z, KEYS[side * 3 + 1], 0, stop)\n"
+    "    local amounts, counts = {}, {}\n"
+    "    -- unpack() is limited by the Lua stack\n"
+    "    for i = 1, #prices, 1000 do\n"
+    "        local j = math.min(i + 999, #prices)\n"
+    "        local a = redis.call('HMGET', KEYS[side * 3 + 2],\n"
+    "                             unpack(prices, i, j))\n"
+    "        local c = redis.call('HMGET', KEYS[side * 3 + 3],\n"
+    "                             unpack(prices, i, j))\n"
+    "        for k = 1, j - i + 1 do\n"
+    "            amounts[i + k - 1] = a[k] or '0'\n"
+    "            counts[i + k - 1] = c[k] or '0'\n"
+    "        end\n"
+    "    end\n"
+    "    result[side * 3 + 1] = prices\n"
+    "    result[side * 3 + 2] = amounts\n"
+    "    result[side * 3 + 3] = counts\n"
+    "end\n"
+    "return result\n"
+};
 
-            freeReplyObject(reply);
+static void depth_callback(redisAsyncContext *ac, void *reply, void *privdata)
+{
+    const char *json_col[2] = {"bids", "asks"};
+    struct request *req = async_reply(reply, privdata, REDIS_REPLY_ARRAY);
+    redisReply *r = reply;
+    int which, n, more = 0;
+
+    if (req && r->elements != 6) {
+        fputs("error: bad reply\n", output);
+        req = NULL;
+    }
+    if (req == NULL) {
+        async_done(privdata);
+        return;
+    }
+    out_begin_object(NULL);
+    for (which = 0; which < 2; which++) {
+        redisReply *prices = r->element[which * 3];
+        out_begin_array(json_col[which]);
+        n = prices->elements;
+        if (req->limit >= 0 && n > req->offset + req->limit) {
+            n = req->offset + req->limit;
+            more = 1;
         }
-        json_object_object_add(list, json_col[which], reqs);
-        freeReplyObject(prices);
+        out_side(prices, r->element[which * 3 + 1], r->element[which * 3 + 2],
+                 n, req->offset);
+        out_end();
     }
+    if (req->limit >= 0) {
+        if (more) out_int("next", req->offset + req->limit);
+        else out_null("next");
+    }
+    out_end();
+    out_finish();
+    async_done(req);
+}
+
+static void depth_async(int offset, int limit)
+{
+    struct request *req;
 
-    puts(json_object_to_json_string_ext(list, JSON_C_TO_STRING_PRETTY));
-    json_object_put(list);
+    req = async_wait();
+    req->offset = offset;
+    req->limit = limit;
+    async_script_command(&depth_script, depth_callback, req,
+                         "6 %s_prices %s_level_amounts %s_level_counts "
+                         "%s_prices %s_level_amounts %s_level_counts %d",
+                         side_key[0], side_key[0], side_key[0],
+                         side_key[1], side_key[1], side_key[1],
+                         limit < 0 ? -1 : offset + limit);
 }
 
-/*
- * Trade the orders at given prices based on FIFO.
- * return: the number of trades
- *         *bid_fully_matched == 1 if bid_price is fully matched.
- *         *ask_fully_matched == 1 if ask_price is fully matched.
- */
-static int trade(double bid_price, double ask_price,
-                 int *bid_fully_matched, int *ask_fully_matched)
+static void history_callback(redisAsyncContext *ac, void *reply,
+                             void *privdata)
 {
-    redisReply *reply;
-    double bid_amount, ask_amount, trade_amount;
-    int trades = 0;
+    struct request *req = async_reply(reply, privdata, REDIS_REPLY_ARRAY);
 
-    while (1) {
-        reply = redisCommand(context, "LINDEX bid_amounts@%f 0", bid_price);
-        if (reply->type == REDIS_REPLY_NIL) {
-            freeReplyObject(reply);
-            reply = redisCommand(context, "ZREM bid_prices %f", bid_price);
-            freeReplyObject(reply);
-            *bid_fully_matched = 1;
-        } else {
-            bid_amount = get_reply_double(reply);
-            freeReplyObject(reply);
-            *bid_fully_matched = 0;
-        }
+    if (req) out_history(reply);
+    async_done(privdata);
+}
 
-        reply = redisCommand(context, "LINDEX ask_amounts@%f 0", ask_price);
-        if (reply->type == REDIS_REPLY_NIL) {
-            freeReplyObject(reply);
-            reply = redisCommand(context, "ZREM ask_prices %f", ask_price);
-            freeReplyObject(reply);
-            *ask_fully_matched = 1;
-        } else {
-            ask_amount = get_reply_double(reply);
-            freeReplyObject(reply);
-            *ask_fully_matched = 0;
-        }
+static void history_async(int start, int stop)
+{
+    redisAsyncCommand(async_context, history_callback, async_wait(),
+                      "LRANGE %smatched_trades %d %d", key_prefix, start,
+                      stop);
+}
 
-        /* Stop when either bid price or ask price run out of amount. */
-        if (*bid_fully_matched == 1 || *ask_fully_matched == 1) break;
+static void match_callback(redisAsyncContext *ac, void *reply,
+                           void *privdata)
+{
+    struct request *req = async_reply(reply, privdata, REDIS_REPLY_INTEGER);
 
-        if (bid_amount > ask_amount) {
-            trade_amount = ask_amount;
-            ask_amount = 0;
-            bid_amount -= trade_amount;
-        } else if (ask_amount > bid_amount) {
-            trade_amount = bid_amount;
-            bid_amount = 0;
-            ask_amount -= trade_amount;
-        } else {
-            bid_amount = 0;
-            ask_amount = 0;
-        }
+    if (req) fprintf(output, "%lld\n", ((redisReply *)reply)->integer);
+    async_done(privdata);
+}
 
-        const char *user;
-        reply = redisCommand(context, "LINDEX bid_users@%f 0", bid_price);
-        user = get_reply_str(reply);
-        freeReplyObject(reply);
-        reply = redisCommand(context, "LPUSH matched_bidders %s", user);
-        freeReplyObject(reply);
-        reply = redisCommand(context, "LINDEX ask_users@%f 0", ask_price);
-        user = get_reply_str(reply);
-        freeReplyObject(reply);
-        reply = redisCommand(context, "LPUSH matched_askers %s", user);
-        freeReplyObject(reply);
-        reply = redisCommand(context, "LPUSH matched_bidprices %f", bid_price);
-        freeReplyObject(reply);
-        reply = redisCommand(context, "LPUSH matched_askprices %f", ask_price);
-        freeReplyObject(reply);
-        reply = redisCommand(context, "LPUSH matched_amounts %f", trade_amount);
-        freeReplyObject(reply);
-        reply = redisCommand(context, "LPUSH matched_timestamps %ld", time(NULL));
-        freeReplyObject(reply);
+static void match_async()
+{
+    begin_match();
+    async_script_command(&match_script, match_callback, async_wait(),
+                         "2 %s_prices %s_prices %lld %s %d %lld",
+                         side_key[0], side_key[1], match_time / NS_PER_SEC,
+                         key_prefix, publish, match_time % NS_PER_SEC);
+}
 
-        trades++;
+/*
+ * Run the complete lines in c->in, and the rest too once the client has
+ * sent everything, or the complete messages with --binary.
+ */
+static void run_client(struct client *c)
+{
+    char *line = c->in, *end = c->in + c->in_len, *next, *argv[MAX_ARGS];
+    int argc;
 
-        if (bid_amount == 0) {
-            reply = redisCommand(context, "LPOP bid_amounts@%f", bid_price);
-            freeReplyObject(reply);
-            reply = redisCommand(context, "LPOP bid_users@%f", bid_price);
-            freeReplyObject(reply);
+    for (; line < end; line = next) {
+        if (binary) {
+            size_t n = message_length(line, end - line);
+            /* An incomplete message at the end is dropped. */
+            if (n == 0) break;
+            next = line + n;
+            argc = -1;
         } else {
-            reply = redisCommand(context, "LSET bid_amounts@%f 0 %f",
-                                 bid_price, bid_amount);
-            freeReplyObject(reply);
+            char *eol = memchr(line, '\n', end - line);
+            if (eol == NULL) {
+                if (!c->eof) break;
+                eol = end;
+            }
+            *eol = '\0';
+            next = eol + 1;
+            argc = split_args(line, argv, MAX_ARGS);
         }
-
-        if (ask_amount == 0) {
-            reply = redisCommand(context, "LPOP ask_amounts@%f", ask_price);
-            freeReplyObject(reply);
-            reply = redisCommand(context, "LPOP ask_users@%f", ask_price);
-            freeReplyObject(reply);
+        if (async_context) {
+            struct request *req = new_request(c);
+            if (c->tail) c->tail->next = req;
+            else c->head = req;
+            c->tail = req;
+            output = req->stream;
+            if (argc < 0 ? is_async_message(line) : is_async(argc, argv)) {
+                async_request = req;
+                if (argc < 0) process_message(line);
+                else process_command(argc, argv);
+                async_request = NULL;
+            } else {
+                /* after the commands sent before */
+                async_drain();
+                if (argc < 0) process_message(line);
+                else process_command(argc, argv);
+                flush_commands();
+            }
+            req->running = 0;
         } else {
-            reply = redisCommand(context, "LSET ask_amounts@%f 0 %f",
-                                 ask_price, ask_amount);
-            freeReplyObject(reply);
+            output = c->stream;
+            if (argc < 0) process_message(line);
+            else process_command(argc, argv);
         }
     }
+    output = stdout;
+    if (async_context) deliver(c);
+    else fflush(c->stream);
 
-    return trades;
+    c->in_len = line < end ? end - line : 0;
+    memmove(c->in, line, c->in_len);
 }
 
 /*
- * Eliminate the overlap between bid prices and ask prices.
- * return: the number of trades
+ * Read what c has sent and run it.
+ *
+ * return: 0 on success, -1 if c should be dropped
  */
-static int match()
+static int read_client(struct client *c)
 {
-    /* bid prices and ask prices */
-    redisReply *bid_prices = redisCommand(context, "ZRANGE bid_prices 0 -1");
-    if (bid_prices->elements == 0) {
-        freeReplyObject(bid_prices);
+    ssize_t r = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+
+    if (r < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    if (r == 0) c->eof = 1;
+    c->in_len += r;
+    if (c->http) {
+        /* Answer any request once its header is complete, and close. */
+        if (c->eof || c->in_len == sizeof(c->in) ||
+            memmem(c->in, c->in_len, "\r\n\r\n", 4)) {
+            fputs("HTTP/1.0 200 OK\r\n"
+                  "Content-Type: text/plain; version=0.0.4\r\n"
+                  "Connection: close\r\n\r\n", c->stream);
+            write_metrics(c->stream);
+            fflush(c->stream);
+            c->eof = 1;
+            c->in_len = 0;
+        }
         return 0;
     }
-    redisReply *ask_prices = redisCommand(context, "ZRANGE ask_prices 0 -1");
-    if (ask_prices->elements == 0) {
-        freeReplyObject(ask_prices);
-        return 0;
+    /* A message always fits, since it is far shorter than a line. */
+    if (!binary && c->in_len == sizeof(c->in) &&
+        !memchr(c->in, '\n', c->in_len)) {
+        fprintf(stderr, "serve: line too long\n");
+        return -1;
+    }
+    run_client(c);
+    return 0;
+}
+
+/*
+ * Send the answers of c as far as the socket takes them.
+ *
+ * return: 1 if all are sent, 0 if some are left, -1 on error
+ */
+static int write_client(struct client *c)
+{
+    while (c->out_sent < c->out_len) {
+        ssize_t w = send(c->fd, c->out + c->out_sent,
+                         c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (w < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        c->out_sent += w;
     }
+    /* Start over at the beginning of the buffer. */
+    fseeko(c->stream, 0, SEEK_SET);
+    fflush(c->stream);
+    c->out_sent = 0;
+    return 1;
+}
 
-    double price;
+/*
+ * http: 1 for the listener of --metrics
+ */
+static void accept_clients(int ep, int listener, int http)
+{
+    struct epoll_event ev;
+    struct client *c;
+    int fd, on = 1;
 
-    /* indices of the lowest bid price which is above or equal to the lowest
-       ask price, and the highest ask price which is below or equal to the
-       highest bid price, respectively */
-    int b_lb, a_ub;
-    price = get_reply_double(ask_prices->element[0]);
-    for (b_lb = bid_prices->elements - 1; b_lb >= 0 &&
-         get_reply_double(bid_prices->element[b_lb]) >= price; b_lb--);
-    b_lb++;
-    price = get_reply_double(bid_prices->element[bid_prices->elements - 1]);
-    for (a_ub = 0; a_ub < ask_prices->elements &&
-         get_reply_double(ask_prices->element[a_ub]) <= price; a_ub++);
-    a_ub--;
+    while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        c = calloc(1, sizeof(struct client));
+        c->fd = fd;
+        c->http = http;
+        c->stream = open_memstream(&c->out, &c->out_len);
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        c->events = ev.events;
+        if (c->stream == NULL) {
+            perror("open_memstream");
+            close(fd);
+            free(c);
+        } else if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev)) {
+            perror("epoll_ctl");
+            close_client(c);
+        }
+    }
+}
 
-    /* no overlap between bid prices and ask prices */
-    if (b_lb >= bid_prices->elements || a_ub < 0) {
-        freeReplyObject(bid_prices);
-        freeReplyObject(ask_prices);
-        return 0;
+/*
+ * Send what the dirty clients have, and drop those done.
+ */
+static void write_clients(int ep)
+{
+    struct epoll_event ev;
+    int i, sent;
+
+    for (i = 0; i < n_dirty; i++) {
+        struct client *c = dirty_clients[i];
+        c->dirty = 0;
+        if (c->closed) {
+            close_client(c);
+            continue;
+        }
+        sent = write_client(c);
+        if (sent < 0 || (sent > 0 && c->eof && c->head == NULL)) {
+            epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+            close_client(c);
+            continue;
+        }
+        /* Wait for room to send the rest, but not for more input after
+           the end. */
+        ev.events = (c->eof ? 0 : EPOLLIN) | (sent ? 0 : EPOLLOUT);
+        if (ev.events != c->events) {
+            ev.data.ptr = c;
+            epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+            c->events = ev.events;
+        }
     }
+    n_dirty = 0;
+}
 
-    /* indices to iterate bid prices and ask prices */
-    int b = b_lb, a = 0;
+static void serve(const char *address)
+{
+    struct epoll_event ev, events[MAX_EVENTS];
+    int ep, listener, n, i, saved_pipelined = pipelined;
 
-    int trades = 0;
+    if (serving) {
+        fputs("already serving\n", output);
+        return;
+    }
+    listener = listen_on(address);
+    if (listener < 0) return;
+    ep = epoll_create1(0);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(ep, EPOLL_CTL_ADD, listener, &ev);
+    if (metrics_address) {
+        metrics_listener = listen_on(metrics_address);
+        if (metrics_listener < 0) {
+            close(ep);
+            close(listener);
+            return;
+        }
+        ev.data.ptr = &metrics_listener;
+        epoll_ctl(ep, EPOLL_CTL_ADD, metrics_listener, &ev);
+    }
+    serve_ep = ep;
+    /* The in-memory book needs no reads from Redis. */
+    if (async_mode && !in_memory && async_connect()) {
+        close(ep);
+        close(listener);
+        if (metrics_listener >= 0) close(metrics_listener);
+        metrics_listener = -1;
+        return;
+    }
 
+    serving = 1;
+    pipelined = 1;
     while (1) {
-        int bid_fully_matched, ask_fully_matched;
-        trades += trade(get_reply_double(bid_prices->element[b]),
-                        get_reply_double(ask_prices->element[a]),
-                        &bid_fully_matched, &ask_fully_matched);
-        if (ask_fully_matched) {
-            a++;
-            if (a > a_ub) break;
-            if (get_reply_double(bid_prices->element[b]) <
-                get_reply_double(ask_prices->element[a])) {
-                do b++; while(get_reply_double(bid_prices->element[b]) <
-                              get_reply_double(ask_prices->element[a]));
-            }
+        n = epoll_wait(ep, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
         }
-        if (bid_fully_matched) {
-            b++;
-            if (b >= bid_prices->elements) break;
+
+        for (i = 0; i < n; i++) {
+            struct client *c = events[i].data.ptr;
+            if (c == NULL) {
+                accept_clients(ep, listener, 0);
+            } else if (c == (void *)&metrics_listener) {
+                accept_clients(ep, metrics_listener, 1);
+            } else if (c == (void *)&async_context) {
+                if (events[i].events & EPOLLOUT) {
+                    redisAsyncHandleWrite(async_context);
+                }
+                if (async_context &&
+                    (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                    redisAsyncHandleRead(async_context);
+                }
+            } else if (c->closed) {
+                continue;
+            } else if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+                       read_client(c)) {
+                epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+                close_client(c);
+            } else {
+                mark_dirty(c);
+            }
         }
-    }
 
-    freeReplyObject(bid_prices);
-    freeReplyObject(ask_prices);
+        /* one round trip for the writes of all the commands above */
+        flush_commands();
+        if (async_context && (async_events & EPOLLOUT)) {
+            redisAsyncHandleWrite(async_context);
+        }
+        /* Meanwhile the commands wait for their replies as without
+           --async. */
+        if (async_mode && !in_memory && async_context == NULL) {
+            async_connect();
+        }
 
-    return trades;
+        write_clients(ep);
+    }
+    pipelined = saved_pipelined;
+    serving = 0;
+    if (async_context) redisAsyncDisconnect(async_context);
+    serve_ep = -1;
+    close(ep);
+    close(listener);
+    if (metrics_listener >= 0) close(metrics_listener);
+    metrics_listener = -1;
 }
 
-void history(int start, int stop)
+/*
+ * return: 1 if str is a decimal integer
+ */
+static int is_integer(const char *str)
 {
-    redisReply *bidders, *bidprices, *askers, *askprices, *amounts, *timestamps;
-    json_object *list, *matched;
-    int i, num;
-    char s[20];
+    char *end;
 
-    list = json_object_new_array();
-
-    bidders = redisCommand(context, "LRANGE matched_bidders %d %d",
-                           start, stop);
-    bidprices = redisCommand(context, "LRANGE matched_bidprices %d %d",
-                             start, stop);
-    askers = redisCommand(context, "LRANGE matched_askers %d %d",
-                          start, stop);
-    askprices = redisCommand(context, "LRANGE matched_askprices %d %d",
-                             start, stop);
-    amounts = redisCommand(context, "LRANGE matched_amounts %d %d",
-                           start, stop);
-    timestamps = redisCommand(context, "LRANGE matched_timestamps %d %d",
-                              start, stop);
-
-    for (num = bidders->elements, i = 0; i < num; i++) {
-        matched = json_object_new_object();
-        
-        json_object_object_add(matched, "bidder",
-            json_object_new_string(get_reply_str(bidders->element[i])));
-        snprintf(s, 20, "%.2lf", get_reply_double(bidprices->element[i]));
-        json_object_object_add(matched, "bidprice", json_object_new_string(s));
-        json_object_object_add(matched, "asker",
-            json_object_new_string(get_reply_str(askers->element[i])));
-        snprintf(s, 20, "%.2lf", get_reply_double(askprices->element[i]));
-        json_object_object_add(matched, "askprice", json_object_new_string(s));
-        snprintf(s, 20, "%.2lf", get_reply_double(amounts->element[i]));
-        json_object_object_add(matched, "amount", json_object_new_string(s));
-        json_object_object_add(matched, "timestamp",
-            json_object_new_string(get_reply_str(timestamps->element[i])));
-        
-        json_object_array_add(list, matched);
-    }
-
-    freeReplyObject(bidders);
-    freeReplyObject(bidprices);
-    freeReplyObject(askers);
-    freeReplyObject(askprices);
-    freeReplyObject(amounts);
-    freeReplyObject(timestamps);
-
-    puts(json_object_to_json_string_ext(list, JSON_C_TO_STRING_PRETTY));
-    json_object_put(list);
+    strtoll(str, &end, 10);
+    return end != str && *end == '\0';
 }
 
-/*
- * argv[0]: command
- * argv[1] ~ argv[argc - 1]: arguments
- */
-static void process_command(int argc, char **argv)
+static void run_command(int argc, char **argv)
 {
     if (argc == 0) return;
+    if (has_symbol(argc, argv)) {
+        if (select_symbol(argv[1], strlen(argv[1]))) {
+            fputs("invalid SYMBOL\n", output);
+            return;
+        }
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    } else if (strcmp(argv[0], "load") != 0) {
+        /* load selects the symbol of each of its orders */
+        select_symbol("", 0);
+    }
     if (strcmp(argv[0], "bid") == 0 || strcmp(argv[0], "ask") == 0) {
         if (argc != 4) {
-            printf("usage: %s [USER] [PRICE] [AMOUNT]\n", argv[0]);
+            fprintf(output, "usage: %s [USER] [PRICE] [AMOUNT]\n", argv[0]);
+            return;
+        }
+        long long price, amount;
+        if (strlen(argv[1]) > MAX_USER) {
+            fputs("USER too long\n", output);
+            return;
+        }
+        if (parse_fixed(argv[2], strlen(argv[2]), &price) ||
+            parse_fixed(argv[3], strlen(argv[3]), &amount)) {
+            fputs("invalid PRICE or AMOUNT\n", output);
+            return;
+        }
+        if (amount == 0) {
+            fputs("invalid AMOUNT\n", output);
+            return;
+        }
+        int which = argv[0][0] == 'a';
+        long long id = in_memory ?
+            engine_bid_ask(which, argv[1], price, amount) :
+            bid_ask(which, argv[1], price, amount);
+        if (id) fprintf(output, "%lld\n", id);
+    } else if (strcmp(argv[0], "cancel") == 0 ||
+               strcmp(argv[0], "amend") == 0) {
+        int cancel = argv[0][0] == 'c';
+        if (argc != (cancel ? 2 : 3)) {
+            fprintf(output, "usage: %s\n",
+                    cancel ? "cancel [ID]" : "amend [ID] [AMOUNT]");
+            return;
+        }
+        char *end;
+        long long id = strtoll(argv[1], &end, 10), amount = 0;
+        if (*end != '\0' || id <= 0) {
+            fputs("invalid ID\n", output);
+            return;
+        }
+        if (!cancel && parse_fixed(argv[2], strlen(argv[2]), &amount)) {
+            fputs("invalid AMOUNT\n", output);
             return;
         }
-        bid_ask(argv[0], argv[1], atof(argv[2]), atof(argv[3]));
+        int done = in_memory ? engine_amend(id, amount) : amend(id, amount);
+        if (done < 0) fputs("AMOUNT exceeds the amount left\n", output);
+        else fprintf(output, "%d\n", done);
     } else if (strcmp(argv[0], "clear") == 0) {
+        if (in_memory) engine_clear();
         clear();
     } else if (strcmp(argv[0], "list") == 0) {
-        list();
+        if (in_memory) engine_depth(0, -1);
+        else list();
+    } else if (strcmp(argv[0], "depth") == 0) {
+        if (argc != 2 && argc != 3) {
+            fputs("usage: depth [N] [OFFSET]\n", output);
+            return;
+        }
+        int limit, offset = 0;
+        /* N of at least 1, so that "next" always moves on */
+        if (parse_int(argv[1], 1, INT_MAX, &limit) ||
+            (argc == 3 && parse_int(argv[2], 0, INT_MAX - limit, &offset))) {
+            fputs("invalid N or OFFSET\n", output);
+            return;
+        }
+        if (in_memory) engine_depth(offset, limit);
+        else depth(offset, limit);
     } else if (strcmp(argv[0], "match") == 0) {
-        printf("%d\n", match());
+        if (in_memory) fprintf(output, "%d\n", engine_match());
+        else if (async_request) match_async();
+        else fprintf(output, "%d\n", lua_match ? match_lua() : match());
     } else if (strcmp(argv[0], "history") == 0) {
-        if (argc != 3) {
-            puts("usage: history [START] [STOP]");
+        const char *user = NULL, *since = NULL, *until = NULL, *range[2];
+        int i, n = 0;
+        for (i = 1; i < argc; i++) {
+            if (strncmp(argv[i], "--", 2) != 0) {
+                if (n == 2) break;
+                range[n++] = argv[i];
+            } else if (i + 1 == argc) {
+                break;
+            } else if (strcmp(argv[i], "--since") == 0) {
+                since = argv[++i];
+            } else if (strcmp(argv[i], "--until") == 0) {
+                until = argv[++i];
+            } else if (strcmp(argv[i], "--user") == 0) {
+                user = argv[++i];
+            } else {
+                break;
+            }
+        }
+        int filtered = user || since || until;
+        if (i < argc || n == 1 || (n == 0 && !filtered)) {
+            fputs("usage: history [START] [STOP] [--since T] [--until T] "
+                  "[--user USER]\n", output);
+            return;
+        }
+        int start = n ? atoi(range[0]) : 0, stop = n ? atoi(range[1]) : -1;
+        if (!filtered) {
+            history(start, stop);
+            return;
+        }
+        if ((since && !is_integer(since)) || (until && !is_integer(until)) ||
+            start < 0) {
+            fputs("invalid T or START\n", output);
+            return;
+        }
+        find_trades(user, since ? since : "-inf", until ? until : "+inf",
+                    start, stop);
+    } else if (strcmp(argv[0], "candles") == 0) {
+        if (argc != 4) {
+            fputs("usage: candles [INTERVAL] [FROM] [TO]\n", output);
+            return;
+        }
+        int interval = strcmp(argv[1], "1s") == 0 ? 1 :
+                       strcmp(argv[1], "1m") == 0 ? 60 :
+                       strcmp(argv[1], "1h") == 0 ? 3600 : 0;
+        char *end_from, *end_to;
+        long long from = strtoll(argv[2], &end_from, 10);
+        long long to = strtoll(argv[3], &end_to, 10);
+        if (interval == 0) {
+            fputs("INTERVAL must be 1s, 1m, or 1h\n", output);
+            return;
+        }
+        if (*end_from != '\0' || *end_to != '\0') {
+            fputs("invalid FROM or TO\n", output);
+            return;
+        }
+        candles(interval, from, to);
+    } else if (strcmp(argv[0], "load") == 0) {
+        if (argc != 2) {
+            fputs("usage: load [FILE]\n", output);
+            return;
+        }
+        load(argv[1]);
+    } else if (strcmp(argv[0], "snapshot") == 0 ||
+               strcmp(argv[0], "restore") == 0) {
+        if (argc != 2) {
+            fprintf(output, "usage: %s [FILE]\n", argv[0]);
+            return;
+        }
+        if (argv[0][0] == 's') snapshot(argv[1]);
+        else restore(argv[1]);
+    } else if (strcmp(argv[0], "serve") == 0) {
+        if (argc != 2) {
+            fputs("usage: serve [ADDRESS]\n", output);
             return;
         }
-        history(atoi(argv[1]), atoi(argv[2]));
+        serve(argv[1]);
+    } else if (strcmp(argv[0], "stats") == 0) {
+        stats();
     } else if (strcmp(argv[0], "help") == 0) {
-        puts("bid [USER] [PRICE] [AMOUNT]   Bid AMOUNT at PRICE");
-        puts("ask [USER] [PRICE] [AMOUNT]   Ask AMOUNT at PRICE");
-        puts("list                          List all unmatched prices");
-        puts("match                         Match bids and asks");
-        puts("history [START] [STOP]        List STARTth to STOPth latest trades");
-        puts("clear                         Remove all data in Redis");
-        puts("help                          Show this help");
+        fputs("bid [USER] [PRICE] [AMOUNT]   Bid AMOUNT at PRICE\n"
+              "ask [USER] [PRICE] [AMOUNT]   Ask AMOUNT at PRICE\n"
+              "cancel [ID]                   Cancel the order ID\n"
+              "amend [ID] [AMOUNT]           Reduce the order ID to AMOUNT\n"
+              "list                          List all unmatched prices\n"
+              "depth [N] [OFFSET]            List N best prices per side "
+              "after OFFSET\n"
+              "match                         Match bids and asks\n"
+              "history [START] [STOP]        List STARTth to STOPth latest "
+              "trades\n"
+              "history [START] [STOP] [--since T] [--until T] [--user USER]\n"
+              "                              The same for the trades from "
+              "T to T, of USER\n"
+              "candles [INTERVAL] [FROM] [TO]\n"
+              "                              List the 1s, 1m, or 1h candles "
+              "from FROM to TO\n"
+              "load [FILE]                   Run the commands in FILE, "
+              "batching orders\n"
+              "snapshot [FILE]               Write the book to FILE\n"
+              "restore [FILE]                Replace the book with the "
+              "snapshot in FILE\n"
+              "serve [ADDRESS]               Run the commands of clients on "
+              "[HOST:]PORT or a\n"
+              "                              Unix socket path\n"
+              "clear                         Remove all data of the book in "
+              "Redis\n"
+              "stats                         Show the calls, Redis commands, "
+              "round trips,\n"
+              "                              and latencies of each "
+              "operation\n"
+              "help                          Show this help\n"
+              "Any command but load, serve, stats, and help may start with a "
+              "SYMBOL to use its\n"
+              "book, "
+              "e.g., bid BTCUSD kugwa 7902.4 5\n", output);
     } else {
-        puts("unknown command");
+        fputs("unknown command\n", output);
     }
 }
 
 /*
- * argc == 1: Get commands from stdin.
- * argc >= 2: Get a command from command line arguments.
+ * return: the STAT_* of command cmd, or -1 if it is not measured
+ */
+static int command_stat(const char *cmd)
+{
+    int op;
+
+    if (strcmp(cmd, "bid") == 0 || strcmp(cmd, "ask") == 0) {
+        return STAT_BID_ASK;
+    }
+    if (strcmp(cmd, "cancel") == 0) return STAT_AMEND;
+    for (op = 0; op < N_STATS; op++) {
+        if (op != STAT_TRADE && strcmp(cmd, stat_name[op]) == 0) return op;
+    }
+    return -1;
+}
+
+/*
+ * argv[0]: command
+ * argv[1] ~ argv[argc - 1]: arguments, optionally led by a SYMBOL
+ */
+static void process_command(int argc, char **argv)
+{
+    int op = argc > 0 ? command_stat(argv[0]) : -1;
+    struct arena_mark mark = arena_mark();
+    long long start = op < 0 ? 0 : stat_begin(op);
+    redisContext *primary = NULL, *replica = NULL;
+    int primary_pending = 0, primary_unsent = 0;
+    struct script_queue primary_scripts;
+
+    check_connection();
+    if (argc > 0 && is_replica_read(argv[0])) replica = pick_replica();
+    if (replica) {
+        /* The commands queued on the primary wait for it to come back. */
+        primary = context;
+        primary_pending = pending;
+        primary_unsent = unsent;
+        primary_scripts = queued_scripts;
+        context = replica;
+        pending = 0;
+        unsent = 0;
+        memset(&queued_scripts, 0, sizeof(queued_scripts));
+    }
+    run_command(argc, argv);
+    if (replica) {
+        flush_commands();
+        context = primary;
+        pending = primary_pending;
+        unsent = primary_unsent;
+        free_script_queue(&queued_scripts);
+        queued_scripts = primary_scripts;
+    }
+    if (op >= 0) stat_end(op, start);
+    /* All of the scratch memory of the command goes at once. */
+    arena_release(mark);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [OPTIONS] [COMMAND]\n", prog);
+    fputs("  --pipeline    Send the writes of each order or trade step "
+          "as one batch\n", stderr);
+    fputs("  --lua         Run match as one server-side Lua script\n", stderr);
+    fputs("  --memory      Keep the book in memory and write behind to "
+          "Redis\n", stderr);
+    fputs("  --batch       Run the commands from stdin as load does\n", stderr);
+    fputs("  --auto-match  Match each order on arrival\n", stderr);
+    fputs("  --compact     Stream JSON on one line\n", stderr);
+    fputs("  --numbers     Write prices, amounts, and counts as JSON "
+          "numbers\n", stderr);
+    fputs("  --workers N   Run the commands from stdin on N threads, one "
+          "per symbol\n", stderr);
+    fputs("  --async       Let serve keep the commands of all clients in "
+          "flight at once\n", stderr);
+    fputs("  --publish     Publish level changes and trades to the market "
+          "channel\n", stderr);
+    fputs("  --metrics ADDRESS  Let serve answer Prometheus scrapes on "
+          "ADDRESS\n", stderr);
+    fputs("  --binary      Read binary order messages from stdin and serve "
+          "clients\n", stderr);
+    fputs("  --redis ADDRESS  Connect to Redis at [HOST:]PORT or a Unix "
+          "socket path\n", stderr);
+    fputs("  --timeout MS  Fail a Redis connect or command after MS "
+          "milliseconds\n", stderr);
+    fputs("  --replica ADDRESS  Read list, depth, history, and candles from "
+          "this replica\n", stderr);
+    fputs("  --max-lag S   Skip a replica which has not heard from its "
+          "primary in S seconds\n", stderr);
+}
+
+/*
+ * No command left after the options: Get commands from stdin.
+ * Otherwise: Get a command from command line arguments.
  */
 int main(int argc, char **argv)
 {
-    context = redisConnect("127.0.0.1", 6379);
-    if (context == NULL) {
-        fprintf(stderr, "redisConnect failed\n");
-        return 1;
+    enum {
+        OPT_PIPELINE = 256, OPT_LUA, OPT_MEMORY, OPT_BATCH, OPT_COMPACT,
+        OPT_NUMBERS, OPT_AUTO_MATCH, OPT_WORKERS, OPT_ASYNC, OPT_PUBLISH,
+        OPT_METRICS, OPT_BINARY, OPT_REDIS, OPT_TIMEOUT, OPT_REPLICA,
+        OPT_MAX_LAG
+    };
+    static const struct option options[] = {
+        {"pipeline", no_argument, NULL, OPT_PIPELINE},
+        {"lua", no_argument, NULL, OPT_LUA},
+        {"memory", no_argument, NULL, OPT_MEMORY},
+        {"batch", no_argument, NULL, OPT_BATCH},
+        {"compact", no_argument, NULL, OPT_COMPACT},
+        {"numbers", no_argument, NULL, OPT_NUMBERS},
+        {"auto-match", no_argument, NULL, OPT_AUTO_MATCH},
+        {"workers", required_argument, NULL, OPT_WORKERS},
+        {"async", no_argument, NULL, OPT_ASYNC},
+        {"publish", no_argument, NULL, OPT_PUBLISH},
+        {"metrics", required_argument, NULL, OPT_METRICS},
+        {"binary", no_argument, NULL, OPT_BINARY},
+        {"redis", required_argument, NULL, OPT_REDIS},
+        {"timeout", required_argument, NULL, OPT_TIMEOUT},
+        {"replica", required_argument, NULL, OPT_REPLICA},
+        {"max-lag", required_argument, NULL, OPT_MAX_LAG},
+        {NULL, 0, NULL, 0}
+    };
+    int opt, batch = 0;
+
+    /* "+" stops at the first command word, so "history 0 -1" is kept. */
+    while ((opt = getopt_long(argc, argv, "+", options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_PIPELINE:
+            pipelined = 1;
+            break;
+        case OPT_LUA:
+            lua_match = 1;
+            break;
+        case OPT_MEMORY:
+            in_memory = 1;
+            pipelined = 1;
+            break;
+        case OPT_BATCH:
+            batch = 1;
+            break;
+        case OPT_COMPACT:
+            compact = 1;
+            break;
+        case OPT_NUMBERS:
+            numbers = 1;
+            break;
+        case OPT_AUTO_MATCH:
+            auto_match = 1;
+            break;
+        case OPT_ASYNC:
+            async_mode = 1;
+            break;
+        case OPT_PUBLISH:
+            publish = 1;
+            break;
+        case OPT_METRICS:
+            metrics_address = optarg;
+            break;
+        case OPT_BINARY:
+            binary = 1;
+            break;
+        case OPT_REDIS:
+            redis_address = optarg;
+            break;
+        case OPT_TIMEOUT:
+            redis_timeout_ms = atol(optarg);
+            if (redis_timeout_ms < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case OPT_REPLICA:
+            if (n_replicas == MAX_REPLICAS) {
+                fprintf(stderr, "at most %d replicas\n", MAX_REPLICAS);
+                return 1;
+            }
+            replica_addresses[n_replicas++] = optarg;
+            break;
+        case OPT_MAX_LAG:
+            replica_max_lag = atoi(optarg);
+            if (replica_max_lag < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case OPT_WORKERS:
+            n_workers = atoi(optarg);
+            if (n_workers < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
     }
-    if (context->err) {
-        fprintf(stderr, "redisConnect: %s\n", context->errstr);
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    output = stdout;
+    context = connect_redis(redis_address);
+    if (context == NULL) return 1;
+    if (n_workers > 0 && start_workers()) {
+        stop_workers();
         return 1;
     }
+    if (in_memory && n_workers == 0) select_symbol("", 0);
 
     if (argc > 1) {
         process_command(argc - 1, argv + 1);
+    } else if (binary) {
+        read_messages(fileno(stdin));
+    } else if (batch) {
+        if (load_fd(fileno(stdin)) < 0) perror("stdin");
     } else {
-        int i, book_argc;
-        char *book_argv[5], _book_argv[5][10];
-        for (i = 0; i < 5; i++) book_argv[i] = _book_argv[i];
+        char *line = NULL, *book_argv[MAX_ARGS];
+        size_t size = 0;
+        ssize_t len;
 
         while (1) {
             /* prompt */
-            if (isatty(fileno(stdin))) printf("book> ");
-            char book_cmd[50];
-            if (fgets(book_cmd, 50, stdin) == NULL) break;
-            for (i = 0; book_cmd[i]; i++) {
-                if (book_cmd[i] == '\n') book_cmd[i] = '\0';
+            if (isatty(fileno(stdin))) {
+                /* Let the written-behind changes reach Redis while the
+                   user is typing. */
+                flush_commands();
+                printf("book> ");
             }
+            if ((len = getline(&line, &size, stdin)) < 0) break;
 
-            /* parse commands */
-            char *arg, *saveptr;
-            arg = strtok_r(book_cmd, " ", &saveptr);
-            for (book_argc = 0; book_argc < 5 && arg != NULL; book_argc++) {
-                strncpy(book_argv[book_argc], arg, 10);
-                arg = strtok_r(NULL, " ", &saveptr);
+            if (n_workers > 0) {
+                dispatch(line, len);
+                continue;
             }
-
-            process_command(book_argc, book_argv);
+            process_command(split_args(line, book_argv, MAX_ARGS), book_argv);
+            if (!in_memory) flush_commands();
         }
+        free(line);
     }
 
+    if (n_workers > 0) stop_workers();
+    flush_commands();
+
+    close_replicas();
     redisFree(context);
     return 0;
 }